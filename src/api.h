@@ -31,6 +31,7 @@ enum {
 	REMOVECONTAINER,
 	PROCESSASYNCEVENT,
 	SIGNALPROCESS,
+	BATCH,				// 25
 };
 
 // "hyperstart" is the special container ID for adding processes.
@@ -40,6 +41,21 @@ enum {
 // This operation is "hyperstart-exec"
 #define HYPERSTART_EXEC_CONTAINER "hyperstart"
 
+/*
+ * DESTROYPOD sends SIGTERM to all processes and SIGKILL to those still
+ * running after a grace period. The payload may set it in ms, | grace |,
+ * an empty payload means DESTROYPOD_GRACE.
+ */
+#define DESTROYPOD_GRACE		10000
+
+/*
+ * channel n is the virtio-serial port sh.hyper.channel.n (0 for control, 1
+ * for the streams), or vsock port HYPER_VSOCK_PORT + n with the vsock
+ * transport. hyperstart listens there and sends READY on each new control
+ * connection.
+ */
+#define HYPER_VSOCK_PORT		2718
+
 /*
  * control message format
  * | ctrl id | length  | payload (length-8)      |
@@ -58,4 +74,138 @@ enum {
 #define STREAM_HEADER_SIZE		12
 #define STREAM_HEADER_LENGTH_OFFSET	8
 
+/*
+ * optional protocol features, negotiated by GETVERSION
+ *
+ * the host may put the features it understands in the GETVERSION payload
+ * | features |, hyperstart replies | APIVERSION | accepted features |
+ * followed by the values of the accepted features, in the order of
+ * their bits.
+ * An empty GETVERSION gets the plain | APIVERSION | reply and no feature.
+ */
+#define FEATURE_BINARY_CMD		(1 << 0)
+#define FEATURE_BATCH			(1 << 1)
+#define FEATURE_REQUEST_ID		(1 << 2)
+#define FEATURE_CTL_CREDIT		(1 << 3)
+
+/*
+ * with FEATURE_CTL_CREDIT the GETVERSION reply also carries the control
+ * receive window, | APIVERSION | features | window |. Counting from the
+ * GETVERSION reply, the host may have at most window bytes which are not
+ * yet returned by NEXT | bytes |, and hyperstart returns the credit in
+ * batches of at least half a window rather than a NEXT for every read.
+ */
+#define CONTROL_CREDIT_WINDOW		65536
+
+#define FEATURE_STREAM_CREDIT		(1 << 4)
+
+/*
+ * with FEATURE_STREAM_CREDIT the host may have at most STREAM_CREDIT_WINDOW
+ * bytes of stdin payload per sequence which are not yet written to the
+ * process. hyperstart returns credit with frames of stream sequence 0
+ * | 0 | length | sequence | bytes | sequence | bytes | ...
+ * each entry being a u64 sequence and the u32 number of bytes consumed.
+ */
+#define STREAM_CREDIT_WINDOW		65536
+#define STREAM_CREDIT_ENTRY_SIZE	12
+
+#define FEATURE_STREAM_COMPRESS		(1 << 5)
+
+/*
+ * with FEATURE_STREAM_COMPRESS hyperstart may compress the output frames
+ * it sends. A compressed frame has STREAM_COMPRESSED set in the length,
+ * the payload is | original size (u32) | LZ4 block |.
+ */
+#define STREAM_COMPRESSED		(1U << 31)
+
+#define FEATURE_MULTI_TTY		(1 << 6)
+
+/*
+ * hyperstart opens the stream ports sh.hyper.channel.1 .. N it finds. With
+ * FEATURE_MULTI_TTY the GETVERSION reply ends with the number of ports
+ * (u32) and the frames of sequence S go out on port 1 + S % ports. Input
+ * may come on any of them.
+ */
+
+/*
+ * control message format with FEATURE_REQUEST_ID, used by both sides for
+ * every message after the GETVERSION reply. ACK and ERROR carry the id of
+ * the request they answer and may arrive out of order, messages initiated
+ * by hyperstart carry id 0. BATCH sub-commands keep the plain format.
+ * | ctrl id | length  | request id | payload (length-12)     |
+ * | . . . . | . . . . | . . . . .  | . . . . . . . . . . . . |
+ * 0         4         8            12                        length
+ */
+#define CONTROL_HEADER_REQID_SIZE	12
+#define CONTROL_HEADER_REQID_OFFSET	8
+
+/*
+ * BATCH payload is a list of control messages in the format above, the
+ * reply is one ACK whose payload holds a result per sub-command
+ * | ACK or ERROR | length | reply payload (length-8) | ACK or ERROR | ...
+ * DESTROYPOD and BATCH itself can't be batched.
+ */
+
+/*
+ * binary (TLV) payload of EXECCMD, WINSIZE, SIGNALPROCESS and KILLCONTAINER,
+ * used instead of json when FEATURE_BINARY_CMD is accepted
+ * | tag | length  | value (length)  | tag | ...
+ * | . | . . . . | . . . . . . . . | . |
+ * 0   1         5                 5+length
+ * strings include the terminating '\0', integers are big endian.
+ */
+#define TLV_HEADER_SIZE			5
+#define TLV_LENGTH_OFFSET		1
+
+enum {
+	TLV_CONTAINER = 1,		// string
+	TLV_PROCESS,			// string
+	TLV_SIGNAL,			// u32
+	TLV_ROW,			// u32
+	TLV_COLUMN,			// u32, 5
+	TLV_TERMINAL,			// u32, non-zero means true
+	TLV_STDIO,			// u64
+	TLV_STDERR,			// u64
+	TLV_USER,			// string
+	TLV_GROUP,			// string, 10
+	TLV_ADDITIONAL_GROUP,		// string, repeatable
+	TLV_ARG,			// string, repeatable
+	TLV_ENV,			// string "KEY=VALUE", repeatable
+	TLV_WORKDIR,			// string
+	TLV_WEIGHT,			// u32, share of the output bandwidth
+	TLV_DATACHANNEL,		// string, see below
+	TLV_COALESCE,			// u32, STREAM_COALESCE_*
+	TLV_TIMEOUT,			// u32, see below
+};
+
+/*
+ * an exec may have a wall-clock limit in ms ("timeout" in json). Once it
+ * is over the process gets SIGTERM, and SIGKILL 2s later if it is still
+ * there. The exit code is reported as usual.
+ */
+
+/*
+ * output coalescing of an exec ("coalesce" in json, "none", "latency" or
+ * "throughput"). hyperstart leaves the output in the pipe or pty for a
+ * short while so that consecutive writes go out as one frame. Without a
+ * policy the output is not held, as with "none".
+ */
+enum {
+	STREAM_COALESCE_DEFAULT = 0,
+	STREAM_COALESCE_NONE,
+	STREAM_COALESCE_LATENCY,
+	STREAM_COALESCE_THROUGHPUT,
+	STREAM_COALESCE_MAX,
+};
+
+/*
+ * an exec without terminal may ask for a dedicated data channel
+ * ("datachannel" in json), connected directly to its stdin and stdout,
+ * and to stderr too if it has no stderr sequence:
+ *   vsock:PORT		vsock connection to PORT of the host
+ *   unix:PATH		unix socket connection, mostly for local tests
+ *   serial:NAME	the virtio-serial port named NAME
+ * The exit code and the eof of the stdio sequence are reported as usual.
+ */
+
 #endif /* _HYPERSTART_API_H_ */
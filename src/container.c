@@ -18,6 +18,7 @@
 #include "util.h"
 #include "hyper.h"
 #include "parse.h"
+#include "idcache.h"
 #include "syscall.h"
 
 static int container_populate_volume(char *src, char *dest)
@@ -675,7 +676,54 @@ static int hyper_setup_pty(struct hyper_container *c)
 	return 0;
 }
 
-int hyper_setup_container(struct hyper_container *container, struct hyper_pod *pod)
+/*
+ * The rootfs is prepared by a helper process, which may take long with a
+ * scsi rescan or volumes to populate. Its report is read from the event
+ * loop and the caller learns the result from the done callback.
+ */
+struct hyper_container_setup {
+	struct hyper_event	ev;
+	struct hyper_container	*c;
+	hyper_container_done	done;
+	void			*data;
+};
+
+static int hyper_container_setup_read(struct hyper_event *he, int efd, int events)
+{
+	struct hyper_container_setup *setup = container_of(he, struct hyper_container_setup, ev);
+	struct hyper_container *c = setup->c;
+	uint32_t type;
+	int ret = 0;
+
+	// eof if the helper died without a word
+	if (hyper_get_type(he->fd, &type) < 0 || type != READY) {
+		fprintf(stderr, "setup container %s rootfs failed\n", c->id);
+		close(c->ns);
+		c->ns = -1;
+		ret = -1;
+	}
+
+	fprintf(stdout, "container %s rootfs is %s\n", c->id, ret < 0 ? "failed" : "ready");
+	hyper_reset_event(he);
+	c->setup = NULL;
+	setup->done(c, ret, setup->data);
+	free(setup);
+	return 0;
+}
+
+static void hyper_container_setup_hup(struct hyper_event *he, int efd)
+{
+	hyper_container_setup_read(he, efd, 0);
+}
+
+static struct hyper_event_ops hyper_container_setup_ops = {
+	.read		= hyper_container_setup_read,
+	.hup		= hyper_container_setup_hup,
+};
+
+/* start preparing the rootfs, done() is called later unless it returns -1 */
+int hyper_setup_container(struct hyper_container *container, struct hyper_pod *pod,
+			  hyper_container_done done, void *data)
 {
 	int stacksize = getpagesize() * 42;
 	struct hyper_container_arg arg = {
@@ -685,13 +733,19 @@ int hyper_setup_container(struct hyper_container *container, struct hyper_pod *p
 		.pipens = {-1, -1},
 	};
 	int flags = CLONE_NEWNS | SIGCHLD;
+	struct hyper_container_setup *setup;
 	char path[128];
 	void *stack;
-	uint32_t type;
 	int pid;
 
 	container->exec.pod = pod;
 
+	setup = calloc(1, sizeof(*setup));
+	if (setup == NULL) {
+		fprintf(stderr, "allocate container setup failed\n");
+		return -1;
+	}
+
 	if (pipe2(arg.pipe, O_CLOEXEC) < 0 || pipe2(arg.pipens, O_CLOEXEC) < 0) {
 		perror("create pipe between pod init execcmd failed");
 		goto fail;
@@ -720,6 +774,10 @@ int hyper_setup_container(struct hyper_container *container, struct hyper_pod *p
 		goto fail;
 	}
 
+	// only the helper may write, its exit closes the pipe
+	close(arg.pipe[1]);
+	arg.pipe[1] = -1;
+
 	sprintf(path, "/proc/%d/ns/mnt", pid);
 	container->ns = open(path, O_RDONLY | O_CLOEXEC);
 	if (container->ns < 0) {
@@ -728,14 +786,17 @@ int hyper_setup_container(struct hyper_container *container, struct hyper_pod *p
 	}
 	hyper_send_type(arg.pipens[1], READY);
 
-	/* wait for ready message */
-	if (hyper_get_type(arg.pipe[0], &type) < 0 || type != READY) {
-		fprintf(stderr, "wait for setup container rootfs failed\n");
+	setup->ev.fd = arg.pipe[0];
+	setup->c = container;
+	setup->done = done;
+	setup->data = data;
+	if (hyper_init_event(&setup->ev, &hyper_container_setup_ops, NULL) < 0 ||
+	    hyper_add_event(hyper_epoll.efd, &setup->ev, EPOLLIN) < 0) {
+		fprintf(stderr, "add container setup event failed\n");
 		goto fail;
 	}
+	container->setup = setup;
 
-	close(arg.pipe[0]);
-	close(arg.pipe[1]);
 	close(arg.pipens[0]);
 	close(arg.pipens[1]);
 	return 0;
@@ -746,21 +807,24 @@ fail:
 	close(arg.pipe[1]);
 	close(arg.pipens[0]);
 	close(arg.pipens[1]);
+	free(setup);
 	return -1;
 }
 
+void hyper_add_container(struct hyper_pod *pod, struct hyper_container *c)
+{
+	list_add_tail(&c->list, &pod->containers);
+	hlist_add_head(&c->hnode,
+		       &pod->container_hash[hyper_hash_str(c->id, HYPER_CONTAINER_HASH_BITS)]);
+}
+
 struct hyper_container *hyper_find_container(struct hyper_pod *pod, const char *id)
 {
 	struct hyper_container *c;
 
-	list_for_each_entry(c, &pod->containers, list) {
-		if (strlen(c->id) != strlen(id))
-			continue;
-
-		if (strncmp(c->id, id, strlen(id)))
-			continue;
-
-		return c;
+	hlist_for_each_entry(c, &pod->container_hash[hyper_hash_str(id, HYPER_CONTAINER_HASH_BITS)], hnode) {
+		if (strcmp(c->id, id) == 0)
+			return c;
 	}
 
 	return NULL;
@@ -774,6 +838,9 @@ void hyper_cleanup_container(struct hyper_container *c, struct hyper_pod *pod)
 	if (umount(root) < 0 && umount2(root, MNT_DETACH))
 		perror("umount devpts failed");
 
+	if (c->zygote != NULL)
+		hyper_zygote_close(c->zygote);
+	hyper_idcache_free(c->ids);
 	close(c->ns);
 	hyper_cleanup_container_portmapping(c, pod);
 	hyper_free_container(c);
@@ -31,8 +31,11 @@ struct port {
 	char *protocol;
 };
 
+struct hyper_idcache;
+
 struct hyper_container {
 	struct list_head	list;
+	struct hlist_node	hnode;	// in the pod index by id
 	struct hyper_exec	exec;
 	int			ns;
 	uint32_t		code;
@@ -52,11 +55,22 @@ struct hyper_container {
 	int			sys_num;
 	int			ports_num;
 	int			initialize;
+	int			use_zygote;
+	/* spawns the processes of the container once started */
+	struct hyper_zygote	*zygote;
+	/* passwd and group files of the rootfs, see idcache.c */
+	struct hyper_idcache	*ids;
+	/* non-NULL while the rootfs is being prepared */
+	struct hyper_container_setup	*setup;
 };
 
 struct hyper_pod;
 
-int hyper_setup_container(struct hyper_container *container, struct hyper_pod *pod);
+typedef void (*hyper_container_done)(struct hyper_container *c, int ret, void *data);
+
+int hyper_setup_container(struct hyper_container *container, struct hyper_pod *pod,
+			  hyper_container_done done, void *data);
+void hyper_add_container(struct hyper_pod *pod, struct hyper_container *c);
 struct hyper_container *hyper_find_container(struct hyper_pod *pod, const char *id);
 void hyper_cleanup_container(struct hyper_container *container, struct hyper_pod *pod);
 void hyper_free_container(struct hyper_container *c);
@@ -9,11 +9,93 @@
 #include "util.h"
 #include "hyper.h"
 #include "event.h"
+#include "uring.h"
+#include "pool.h"
+
+static int hyper_epoll_create(void)
+{
+	return epoll_create1(EPOLL_CLOEXEC);
+}
+
+static int hyper_epoll_ctl(int efd, int op, struct hyper_event *he, int flag)
+{
+	struct epoll_event event = {
+		.events		= flag,
+		.data.ptr	= he,
+	};
+
+	return epoll_ctl(efd, op, he->fd, &event);
+}
+
+static int hyper_epoll_wait(int efd, struct epoll_event *events, int max)
+{
+	return epoll_wait(efd, events, max, -1);
+}
+
+static struct hyper_event_backend hyper_epoll_backend = {
+	.name		= "epoll",
+	.create		= hyper_epoll_create,
+	.ctl		= hyper_epoll_ctl,
+	.wait		= hyper_epoll_wait,
+};
+
+static struct hyper_event_backend *hyper_backend = &hyper_epoll_backend;
+
+/*
+ * The loop waits on epoll, with hyper.event=io_uring on the kernel cmdline
+ * (or HYPER_EVENT in the environment) it polls the events on an io_uring
+ * instead. Both drive the same hyper_event_ops.
+ */
+void hyper_event_backend_init(char *cmdline)
+{
+	char *opt = getenv("HYPER_EVENT");
+	int len;
+
+	if (opt == NULL && cmdline != NULL) {
+		opt = strstr(cmdline, "hyper.event=");
+		if (opt != NULL)
+			opt += strlen("hyper.event=");
+	}
+
+	if (opt == NULL)
+		return;
+
+	len = strcspn(opt, " \n");
+	if (len == strlen("io_uring") && !strncmp(opt, "io_uring", len))
+		hyper_backend = &hyper_uring_backend;
+	else if (len != strlen("epoll") || strncmp(opt, "epoll", len))
+		fprintf(stderr, "unknown event backend %.*s, use epoll\n", len, opt);
+}
+
+/* create the event fd of the loop, fall back to epoll if the backend fails */
+int hyper_create_events(void)
+{
+	int efd;
+
+	efd = hyper_backend->create();
+	if (efd < 0 && hyper_backend != &hyper_epoll_backend) {
+		fprintf(stderr, "%s is not available, use epoll\n", hyper_backend->name);
+		hyper_backend = &hyper_epoll_backend;
+		efd = hyper_backend->create();
+	}
+
+	if (efd >= 0)
+		fprintf(stdout, "event backend %s\n", hyper_backend->name);
+
+	return efd;
+}
+
+int hyper_wait_event(int efd, struct epoll_event *events, int max)
+{
+	return hyper_backend->wait(efd, events, max);
+}
 
 void hyper_reset_event(struct hyper_event *he)
 {
-	free(he->rbuf.data);
-	free(he->wbuf.data);
+	if (he->fd >= 0 && hyper_backend->close)
+		hyper_backend->close(hyper_epoll.efd, he);
+	hyper_buf_free(he->rbuf.data, he->rbuf.size);
+	hyper_buf_free(he->wbuf.data, he->wbuf.size);
 	close(he->fd);
 	memset(he, 0, sizeof(*he));
 	he->fd = -1;
@@ -33,7 +115,7 @@ int hyper_init_event(struct hyper_event *he, struct hyper_event_ops *ops, void *
 	wbuf->size	= ops->wbuf_size;
 
 	if (rbuf->size) {
-		rbuf->data = malloc(rbuf->size);
+		rbuf->data = hyper_buf_alloc(rbuf->size);
 		if (rbuf->data == NULL) {
 			fprintf(stderr, "allocate read buffer for event failed\n");
 			return -1;
@@ -41,7 +123,7 @@ int hyper_init_event(struct hyper_event *he, struct hyper_event_ops *ops, void *
 	}
 
 	if (wbuf->size) {
-		wbuf->data = malloc(wbuf->size);
+		wbuf->data = hyper_buf_alloc(wbuf->size);
 		if (wbuf->data == NULL) {
 			fprintf(stderr, "allocate write buffer for event failed\n");
 			return -1;
@@ -53,11 +135,6 @@ int hyper_init_event(struct hyper_event *he, struct hyper_event_ops *ops, void *
 
 int hyper_add_event(int efd, struct hyper_event *he, int flag)
 {
-	struct epoll_event event = {
-		.events		= flag,
-		.data.ptr	= he,
-	};
-
 	he->flag = flag;
 	if (hyper_setfd_nonblock(he->fd) < 0) {
 		perror("set fd nonblock failed");
@@ -66,7 +143,7 @@ int hyper_add_event(int efd, struct hyper_event *he, int flag)
 
 	fprintf(stdout, "%s add event fd %d, %p\n", __func__, he->fd, he->ops);
 
-	if (epoll_ctl(efd, EPOLL_CTL_ADD, he->fd, &event) < 0) {
+	if (hyper_backend->ctl(efd, EPOLL_CTL_ADD, he, flag) < 0) {
 		perror("epoll_ctl fd failed");
 		return -1;
 	}
@@ -74,21 +151,25 @@ int hyper_add_event(int efd, struct hyper_event *he, int flag)
 	return 0;
 }
 
-int hyper_modify_event(int efd, struct hyper_event *he, int flag)
+int hyper_del_event(int efd, struct hyper_event *he)
 {
-	struct epoll_event event = {
-		.events		= flag,
-		.data.ptr	= he,
-	};
+	return hyper_backend->ctl(efd, EPOLL_CTL_DEL, he, 0);
+}
 
+int hyper_modify_event(int efd, struct hyper_event *he, int flag)
+{
 	if (he->flag == flag)
 		return 0;
 
 	he->flag = flag;
+	// not connected, the flag is applied when the fd is added back
+	if (he->fd < 0)
+		return 0;
+
 	fprintf(stdout, "%s modify event fd %d, %p, event %d\n",
 			__func__, he->fd, he, flag);
 
-	if (epoll_ctl(efd, EPOLL_CTL_MOD, he->fd, &event) < 0) {
+	if (hyper_backend->ctl(efd, EPOLL_CTL_MOD, he, flag) < 0) {
 		perror("epoll_ctl fd failed");
 		return -1;
 	}
@@ -96,58 +177,117 @@ int hyper_modify_event(int efd, struct hyper_event *he, int flag)
 	return 0;
 }
 
-int hyper_wbuf_append_msg(struct hyper_event *he, uint8_t *data, uint32_t len)
+/*
+ * map len bytes at offset off from the buffer head to at most two iovecs,
+ * the wbuf is a ring and the range may wrap around the end of data.
+ */
+int hyper_buf_iov(struct hyper_buf *buf, uint32_t off, uint32_t len, struct iovec *iov)
 {
-	struct hyper_buf *buf = &he->wbuf;
+	uint32_t pos, first;
 
-	if (buf->get + len > buf->size) {
-		uint8_t *data;
-		fprintf(stdout, "%s: tty buf full\n", __func__);
+	if (len == 0)
+		return 0;
 
-		data = realloc(buf->data, buf->size + len);
-		if (data == NULL) {
-			perror("realloc failed");
-			return -1;
-		}
-		buf->data = data;
-		buf->size += len;
+	pos = (buf->head + off) % buf->size;
+	first = buf->size - pos;
+
+	iov[0].iov_base = buf->data + pos;
+	if (len <= first) {
+		iov[0].iov_len = len;
+		return 1;
 	}
 
-	memcpy(buf->data + buf->get, data, len);
-	buf->get += len;
+	iov[0].iov_len = first;
+	iov[1].iov_base = buf->data;
+	iov[1].iov_len = len - first;
+	return 2;
+}
 
-	hyper_modify_event(hyper_epoll.efd, he, he->flag| EPOLLOUT);
-	return 0;
+void hyper_buf_write(struct hyper_buf *buf, uint32_t off, uint8_t *data, uint32_t len)
+{
+	struct iovec iov[2];
+	int i, n;
+
+	n = hyper_buf_iov(buf, off, len, iov);
+	for (i = 0; i < n; i++) {
+		memcpy(iov[i].iov_base, data, iov[i].iov_len);
+		data += iov[i].iov_len;
+	}
 }
 
-int hyper_requeue_event(int efd, struct hyper_event *ev)
+/* make room for len more bytes, the buffer doesn't grow beyond WBUF_MAX_SIZE */
+int hyper_buf_reserve(struct hyper_buf *buf, uint32_t len)
 {
-	struct epoll_event event = {
-		.events		= ev->flag,
-		.data.ptr	= ev,
-	};
+	struct iovec iov[2];
+	uint32_t size, copied = 0;
+	uint8_t *data;
+	int i, n;
+
+	if (buf->size - buf->get >= len)
+		return 0;
 
-	if (epoll_ctl(efd, EPOLL_CTL_DEL, ev->fd, NULL) < 0) {
-		perror("epoll_ctl del fd failed");
+	if (buf->get + len > WBUF_MAX_SIZE) {
+		fprintf(stderr, "%s: buffer is full, %" PRIu32 " queued\n", __func__, buf->get);
 		return -1;
 	}
 
-	if (epoll_ctl(efd, EPOLL_CTL_ADD, ev->fd, &event) < 0) {
-		perror("epoll_ctl add fd failed");
+	size = buf->size ? buf->size : len;
+	while (size - buf->get < len)
+		size *= 2;
+	if (size > WBUF_MAX_SIZE)
+		size = WBUF_MAX_SIZE;
+
+	data = hyper_buf_alloc(size);
+	if (data == NULL) {
+		perror("allocate buffer failed");
 		return -1;
 	}
 
+	n = hyper_buf_iov(buf, 0, buf->get, iov);
+	for (i = 0; i < n; i++) {
+		memcpy(data + copied, iov[i].iov_base, iov[i].iov_len);
+		copied += iov[i].iov_len;
+	}
+
+	hyper_buf_free(buf->data, buf->size);
+	buf->data = data;
+	buf->size = size;
+	buf->head = 0;
+	return 0;
+}
+
+void hyper_buf_consume(struct hyper_buf *buf, uint32_t len)
+{
+	buf->get -= len;
+	if (buf->get == 0)
+		buf->head = 0;
+	else
+		buf->head = (buf->head + len) % buf->size;
+}
+
+int hyper_wbuf_append_msg(struct hyper_event *he, uint8_t *data, uint32_t len)
+{
+	struct hyper_buf *buf = &he->wbuf;
+
+	if (hyper_buf_reserve(buf, len) < 0)
+		return -1;
+
+	hyper_buf_write(buf, buf->get, data, len);
+	buf->get += len;
+
+	hyper_modify_event(hyper_epoll.efd, he, he->flag| EPOLLOUT);
 	return 0;
 }
 
 int hyper_event_write(struct hyper_event *he, int efd, int events)
 {
 	struct hyper_buf *buf = &he->wbuf;
-	uint32_t len = 0;
-	int size = 0;
+	struct iovec iov[2];
+	int n, size = 0;
 
-	while (len < buf->get) {
-		size = write(he->fd, buf->data + len, buf->get - len);
+	while (buf->get > 0) {
+		n = hyper_buf_iov(buf, 0, buf->get, iov);
+		size = writev(he->fd, iov, n);
 		if (size <= 0) {
 			if (errno == EINTR)
 				continue;
@@ -155,12 +295,9 @@ int hyper_event_write(struct hyper_event *he, int efd, int events)
 				break;
 			return -1;
 		}
-		len += size;
+		hyper_buf_consume(buf, size);
 	}
 
-	buf->get -= len;
-	memmove(buf->data, buf->data + len, buf->get);
-
 	if (buf->get == 0) {
 		hyper_modify_event(hyper_epoll.efd, he, he->flag & ~EPOLLOUT);
 	}
@@ -170,7 +307,7 @@ int hyper_event_write(struct hyper_event *he, int efd, int events)
 
 void hyper_event_hup(struct hyper_event *he, int efd)
 {
-	if (epoll_ctl(efd, EPOLL_CTL_DEL, he->fd, NULL) < 0)
+	if (hyper_del_event(efd, he) < 0)
 		perror("epoll_ctl del epoll event failed");
 	hyper_reset_event(he);
 }
@@ -181,12 +318,12 @@ int hyper_handle_event(int efd, struct epoll_event *event)
 
 	/* do not handle hup event if have in/out event */
 	if ((event->events & EPOLLIN) && he->ops->read) {
-		fprintf(stdout, "%s event EPOLLIN, he %p, fd %d, %p\n",
+		dprintf(stdout, "%s event EPOLLIN, he %p, fd %d, %p\n",
 			__func__, he, he->fd, he->ops);
 		return he->ops->read(he, efd, event->events);
 	}
 	if ((event->events & EPOLLOUT) && he->ops->write) {
-		fprintf(stdout, "%s event EPOLLOUT, he %p, fd %d, %p\n",
+		dprintf(stdout, "%s event EPOLLOUT, he %p, fd %d, %p\n",
 			__func__, he, he->fd, he->ops);
 		return he->ops->write(he, efd, event->events);
 	}
@@ -3,6 +3,7 @@
 
 #include <inttypes.h>
 #include <sys/epoll.h>
+#include <sys/uio.h>
 
 struct hyper_event;
 
@@ -14,7 +15,9 @@ struct hyper_event_ops {
 	int		wbuf_size;
 };
 
+/* get bytes of data from head on, head only moves for the wbuf ring */
 struct hyper_buf {
+	uint32_t		head;
 	uint32_t		get;
 	uint32_t		size;
 	uint8_t			*data;
@@ -30,17 +33,39 @@ struct hyper_event {
 	void			*ptr;
 };
 
+/*
+ * the readiness source of the loop, it reports hyper_event pointers in
+ * epoll_events whatever it polls with.
+ */
+struct hyper_event_backend {
+	const char	*name;
+	int		(*create)(void);
+	int		(*ctl)(int efd, int op, struct hyper_event *he, int flag);
+	int		(*wait)(int efd, struct epoll_event *events, int max);
+	/* the fd of he is about to be closed, NULL if closing drops it */
+	void		(*close)(int efd, struct hyper_event *he);
+};
+
 #define FULL(buf) \
 	(buf->size - buf->get <= 12)
 
+#define WBUF_MAX_SIZE	(4 << 20)
+
+void hyper_event_backend_init(char *cmdline);
+int hyper_create_events(void);
+int hyper_wait_event(int efd, struct epoll_event *events, int max);
 int hyper_add_event(int efd, struct hyper_event *de, int flag);
+int hyper_del_event(int efd, struct hyper_event *de);
 int hyper_modify_event(int efd, struct hyper_event *de, int flag);
-int hyper_requeue_event(int efd, struct hyper_event *ev);
 int hyper_init_event(struct hyper_event *de, struct hyper_event_ops *ops,
 		     void *arg);
 int hyper_handle_event(int efd, struct epoll_event *event);
 void hyper_reset_event(struct hyper_event *de);
 void hyper_event_hup(struct hyper_event *de, int efd);
 int hyper_event_write(struct hyper_event *de, int efd, int events);
+int hyper_buf_iov(struct hyper_buf *buf, uint32_t off, uint32_t len, struct iovec *iov);
+void hyper_buf_write(struct hyper_buf *buf, uint32_t off, uint8_t *data, uint32_t len);
+int hyper_buf_reserve(struct hyper_buf *buf, uint32_t len);
+void hyper_buf_consume(struct hyper_buf *buf, uint32_t len);
 int hyper_wbuf_append_msg(struct hyper_event *de, uint8_t *data, uint32_t len);
 #endif
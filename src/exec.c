@@ -8,7 +8,10 @@
 #include <sys/ioctl.h>
 #include <sys/wait.h>
 #include <sys/socket.h>
+#include <sys/signalfd.h>
+#include <sys/mman.h>
 #include <dirent.h>
+#include <poll.h>
 #include <sched.h>
 #include <errno.h>
 #include <string.h>
@@ -16,12 +19,17 @@
 #include <fcntl.h>
 #include <inttypes.h>
 #include <grp.h>
+#include <limits.h>
 #include <pwd.h>
 
 #include "hyper.h"
 #include "util.h"
 #include "parse.h"
 #include "syscall.h"
+#include "lz4.h"
+#include "pool.h"
+#include "transport.h"
+#include "idcache.h"
 
 struct stdio_config {
 	int stdinfd, stdoutfd, stderrfd;
@@ -30,14 +38,14 @@ struct stdio_config {
 
 static int hyper_release_exec(struct hyper_exec *);
 static void hyper_exec_process(struct hyper_exec *exec, struct stdio_config *io);
+static void hyper_exec_track_pid(struct hyper_exec *exec);
+static void hyper_exec_timeout(struct hyper_timer *t);
+static void hyper_exec_exited(struct hyper_exec *exec, uint8_t code);
+static struct hyper_exec *hyper_find_launching(struct hyper_pod *pod, const char *process);
 
 static int send_exec_finishing(uint64_t seq, int len, int code)
 {
-	int ret = -1;
-	uint8_t *data = malloc(len);
-	if (data == NULL) {
-		goto fail;
-	}
+	uint8_t data[STREAM_HEADER_SIZE + 1];
 
 	/* no in event, no more data, send eof */
 	hyper_set_be64(data, seq);
@@ -45,10 +53,7 @@ static int send_exec_finishing(uint64_t seq, int len, int code)
 	if (len > 12)
 		data[12] = code;
 
-	ret = hyper_wbuf_append_msg(&hyper_epoll.tty, data, len);
-fail:
-	free(data);
-	return ret;
+	return hyper_wbuf_append_msg(&hyper_tty_of(seq)->ev, data, len);
 }
 
 static int hyper_send_exec_eof(struct hyper_exec *exec) {
@@ -65,12 +70,273 @@ static int hyper_send_exec_code(struct hyper_exec *exec) {
 	return hyper_ctl_append_msg(&hyper_epoll.ctl, PROCESSASYNCEVENT, (uint8_t *)pae, strlen(pae));
 }
 
+/* payloads smaller than this go through the tty buffer */
+#define SPLICE_MIN_SIZE		8192
+#define SPLICE_MAX_SIZE		65536
+
+/*
+ * read the unspliced rest of the current frame into the tty buffer. It goes
+ * to the head of the buffer when the frame header was sent directly, since
+ * everything queued there was produced after the frame. If the pipe fails,
+ * the frame is cut short and the stream hung up, nothing is made up for
+ * the missing bytes.
+ */
+static int pts_splice_copy_rest(struct hyper_tty *tty, int head)
+{
+	static uint8_t data[SPLICE_MAX_SIZE];
+	struct hyper_event *src = tty->splice_src;
+	struct hyper_buf *buf = &tty->ev.wbuf;
+	uint32_t left = tty->splice_left, got = 0;
+	int size;
+
+	if (hyper_buf_reserve(buf, left) < 0) {
+		fprintf(stderr, "no room in tty buffer for spliced frame\n");
+		return -1;
+	}
+
+	while (got < left) {
+		size = read(src->fd, data + got, left - got);
+		if (size > 0) {
+			got += size;
+			continue;
+		}
+		if (size < 0 && errno == EINTR)
+			continue;
+		perror("read the rest of spliced frame failed");
+		break;
+	}
+
+	if (head) {
+		buf->head = (buf->head + buf->size - got) % buf->size;
+		hyper_buf_write(buf, 0, data, got);
+	} else {
+		hyper_buf_write(buf, buf->get, data, got);
+	}
+	buf->get += got;
+
+	tty->splice_src = NULL;
+	tty->splice_left = 0;
+	hyper_modify_event(hyper_epoll.efd, &tty->ev, tty->ev.flag | EPOLLOUT);
+
+	if (got < left) {
+		fprintf(stderr, "spliced frame cut short by %" PRIu32 " bytes\n", left - got);
+		src->ops->hup(src, hyper_epoll.efd);
+	}
+	return 0;
+}
+
+/*
+ * move the pending frame payload from the exec pipe to tty, returns 1 if
+ * tty is not writable and the splice is still pending.
+ */
+int hyper_splice_continue(struct hyper_tty *tty)
+{
+	struct hyper_event *src = tty->splice_src;
+	ssize_t size;
+
+	if (src == NULL)
+		return 0;
+
+	while (tty->splice_left > 0) {
+		size = splice(src->fd, NULL, tty->ev.fd, NULL, tty->splice_left,
+			      SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (size > 0) {
+			tty->splice_left -= size;
+			continue;
+		}
+		if (size < 0 && errno == EINTR)
+			continue;
+		if (size < 0 && errno == EAGAIN) {
+			/* the scheduler stays off the tty until the frame is done */
+			hyper_modify_event(hyper_epoll.efd, &tty->ev, tty->ev.flag | EPOLLOUT);
+			return 1;
+		}
+
+		if (size < 0 && errno == EINVAL) {
+			fprintf(stdout, "tty channel doesn't support splice\n");
+			hyper_epoll.splice_off = 1;
+		} else {
+			perror("splice exec output to tty failed");
+		}
+		pts_splice_copy_rest(tty, 1);
+		return 0;
+	}
+
+	tty->splice_src = NULL;
+	return 0;
+}
+
+/*
+ * send a large chunk of pipe output as one frame: the header is written
+ * to tty, then the payload is spliced without passing through user space.
+ * Returns the payload size, or 0 if the data should go through the tty
+ * buffer instead.
+ */
+static int pts_splice(struct hyper_tty *tty, struct hyper_event *de, uint64_t seq)
+{
+	uint8_t hdr[STREAM_HEADER_SIZE];
+	int avail, size;
+
+	if (hyper_epoll.splice_off || tty->splice_src || tty->ev.wbuf.get > 0 || tty->ev.hup)
+		return 0;
+
+	// compressed frames go through the tty buffer
+	if (hyper_epoll.features & FEATURE_STREAM_COMPRESS)
+		return 0;
+
+	if (ioctl(de->fd, FIONREAD, &avail) < 0 || avail < SPLICE_MIN_SIZE)
+		return 0;
+
+	if (avail > SPLICE_MAX_SIZE)
+		avail = SPLICE_MAX_SIZE;
+
+	hyper_set_be64(hdr, seq);
+	hyper_set_be32(hdr + STREAM_HEADER_LENGTH_OFFSET, avail + STREAM_HEADER_SIZE);
+	do {
+		size = write(tty->ev.fd, hdr, sizeof(hdr));
+	} while (size < 0 && errno == EINTR);
+
+	if (size <= 0)
+		return 0;
+
+	dprintf(stdout, "%s: splice %d data\n", __func__, avail);
+	tty->splice_src = de;
+	tty->splice_left = avail;
+
+	if (size < sizeof(hdr)) {
+		/* queue the rest of the header, the payload has to follow it */
+		hyper_wbuf_append_msg(&tty->ev, hdr + size, sizeof(hdr) - size);
+		pts_splice_copy_rest(tty, 0);
+		return avail;
+	}
+
+	hyper_splice_continue(tty);
+	return avail;
+}
+
+/* finish the pending splice through the tty buffer, e.g. before flushing it */
+void hyper_splice_finish(struct hyper_tty *tty)
+{
+	if (tty->splice_src)
+		pts_splice_copy_rest(tty, 1);
+}
+
 static void pts_hup(struct hyper_event *de, int efd, struct hyper_exec *exec)
 {
 	hyper_event_hup(de, efd);
 	hyper_release_exec(exec);
 }
 
+/*
+ * Output of the execs shares the tty ports. Readable streams are queued
+ * on their port and served in deficit round-robin order: each turn a
+ * stream may send STREAM_QUANTUM * weight bytes, a spliced chunk larger
+ * than that is paid back in the following rounds. Streams of tty sessions
+ * are queued at the head so interactive output goes out first. The output
+ * fds are edge triggered, a stream stays queued until its fd is drained.
+ */
+#define STREAM_QUANTUM		4096
+#define STREAM_MAX_WEIGHT	16
+
+static void pts_stream_init(struct hyper_stream *s, struct hyper_event *de,
+			    struct hyper_exec *exec, uint64_t seq)
+{
+	INIT_LIST_HEAD(&s->list);
+	s->ev = de;
+	s->exec = exec;
+	s->seq = seq;
+	s->deficit = 0;
+	s->active = 0;
+	s->hup = 0;
+}
+
+static void pts_stream_start(struct hyper_stream *s)
+{
+	if (s->active)
+		return;
+
+	hyper_timer_del(&s->timer);
+
+	s->active = 1;
+	s->deficit = 0;
+	s->tty = hyper_tty_of(s->seq);
+	if (s->exec->tty)
+		list_add(&s->list, &s->tty->streams);
+	else
+		list_add_tail(&s->list, &s->tty->streams);
+}
+
+static void pts_stream_stop(struct hyper_stream *s)
+{
+	if (!s->active)
+		return;
+
+	s->active = 0;
+	list_del_init(&s->list);
+}
+
+/*
+ * An idle stream that becomes readable is held for a while instead of
+ * being queued at once, so a process writing line by line produces one
+ * frame for many writes. It is queued when the pipe or pty has the
+ * policy's bytes buffered or when its hold time is over.
+ */
+struct hyper_coalesce {
+	int	msec;
+	int	bytes;
+};
+
+static const struct hyper_coalesce coalesce_policy[STREAM_COALESCE_MAX] = {
+	[STREAM_COALESCE_LATENCY]	= { .msec = 2,	.bytes = 512 },
+	// stay below the default pipe size so the writer never blocks
+	[STREAM_COALESCE_THROUGHPUT]	= { .msec = 20,	.bytes = 32768 },
+};
+
+/* the hold time is over */
+static void pts_stream_expire(struct hyper_timer *t)
+{
+	struct hyper_stream *s = container_of(t, struct hyper_stream, timer);
+
+	pts_stream_start(s);
+	hyper_stream_schedule(s->tty);
+}
+
+/* returns 1 if the stream is held back, 0 if it should be queued now */
+static int pts_stream_hold(struct hyper_stream *s)
+{
+	const struct hyper_coalesce *c = &coalesce_policy[s->exec->coalesce];
+	int avail;
+
+	if (s->active || s->hup || c->msec == 0)
+		return 0;
+
+	if (ioctl(s->ev->fd, FIONREAD, &avail) < 0 || avail >= c->bytes)
+		return 0;
+
+	if (!hyper_timer_pending(&s->timer))
+		hyper_timer_add(&s->timer, c->msec, pts_stream_expire);
+
+	return 1;
+}
+
+/* the fd is hung up, release it once the queued output is drained */
+static void pts_stream_hup(struct hyper_stream *s)
+{
+	if (hyper_timer_pending(&s->timer)) {
+		s->hup = 1;
+		pts_stream_start(s);
+		hyper_stream_schedule(s->tty);
+		return;
+	}
+
+	if (s->active) {
+		s->hup = 1;
+		return;
+	}
+
+	pts_hup(s->ev, hyper_epoll.efd, s->exec);
+}
+
 static void stdin_hup(struct hyper_event *de, int efd)
 {
 	struct hyper_exec *exec = container_of(de, struct hyper_exec, stdinev);
@@ -82,72 +348,186 @@ static void stdout_hup(struct hyper_event *de, int efd)
 {
 	struct hyper_exec *exec = container_of(de, struct hyper_exec, stdoutev);
 	fprintf(stdout, "%s, seq %" PRIu64", id %s\n", __func__, exec->seq, exec->id);
-	return pts_hup(de, efd, exec);
+	pts_stream_hup(&exec->outstream);
 }
 
 static void stderr_hup(struct hyper_event *de, int efd)
 {
 	struct hyper_exec *exec = container_of(de, struct hyper_exec, stderrev);
 	fprintf(stdout, "%s, seq %" PRIu64", id %s\n", __func__, exec->seq, exec->id);
-	return pts_hup(de, efd, exec);
+	pts_stream_hup(&exec->errstream);
 }
 
-static int pts_loop(struct hyper_event *de, uint64_t seq, int efd, struct hyper_exec *exec)
+// stdout and stderr of non-tty process and stderr with its own seq are pipes
+static int pts_is_pipe(struct hyper_event *de, struct hyper_exec *exec)
 {
-	int size = -1;
-	int flag = de->flag | EPOLLOUT;
-	struct hyper_buf *buf = &hyper_epoll.tty.wbuf;
+	return !exec->tty || (de == &exec->stderrev && exec->errseq > 0);
+}
 
-	if (FULL(buf)) {
-		goto out;
+/* smaller output is sent as it is, it's likely interactive */
+#define STREAM_COMPRESS_MIN_SIZE	1024
+
+/*
+ * compress the payload just read behind the frame header at the tail of
+ * the tty ring, returns the payload size to send.
+ */
+static int pts_compress(struct hyper_buf *buf, int size)
+{
+	static uint8_t raw[STREAM_QUANTUM * STREAM_MAX_WEIGHT];
+	static uint8_t lz[sizeof(raw)];
+	struct iovec iov[2];
+	uint8_t *src;
+	int n, len;
+
+	if (size < STREAM_COMPRESS_MIN_SIZE || size > sizeof(raw))
+		return size;
+
+	n = hyper_buf_iov(buf, buf->get + STREAM_HEADER_SIZE, size, iov);
+	src = iov[0].iov_base;
+	if (n > 1) {
+		memcpy(raw, iov[0].iov_base, iov[0].iov_len);
+		memcpy(raw + iov[0].iov_len, iov[1].iov_base, iov[1].iov_len);
+		src = raw;
+	}
+
+	// only worth it if the frame gets smaller
+	len = hyper_lz4_compress(src, size, lz + 4, size - 5);
+	if (len == 0)
+		return size;
+
+	hyper_set_be32(lz, size);
+	hyper_buf_write(buf, buf->get + STREAM_HEADER_SIZE, lz, len + 4);
+	return len + 4;
+}
+
+/*
+ * move one chunk of the stream into the tty channel. Returns the payload
+ * size, or -1 if the stream left the queue.
+ */
+static int pts_loop(struct hyper_stream *s)
+{
+	struct hyper_event *de = s->ev;
+	struct hyper_exec *exec = s->exec;
+	struct hyper_buf *buf = &s->tty->ev.wbuf;
+	int len = buf->size - buf->get - STREAM_HEADER_SIZE;
+	uint8_t hdr[STREAM_HEADER_SIZE];
+	struct iovec iov[2];
+	int n, size;
+
+	if (pts_is_pipe(de, exec)) {
+		size = pts_splice(s->tty, de, s->seq);
+		if (size > 0)
+			return size;
 	}
 
+	if (len > s->deficit)
+		len = s->deficit;
+
+	/* the frame may wrap around the end of the tty ring */
+	n = hyper_buf_iov(buf, buf->get + STREAM_HEADER_SIZE, len, iov);
 	do {
-		size = read(de->fd, buf->data + buf->get + 12, buf->size - buf->get - 12);
-		if (size < 0) {
-			if (errno == EINTR)
-				continue;
+		size = readv(de->fd, iov, n);
+	} while (size < 0 && errno == EINTR);
+
+	if (size > 0) {
+		uint32_t length;
+
+		dprintf(stdout, "%s: read %d data\n", __func__, size);
+		len = size;
+		if (hyper_epoll.features & FEATURE_STREAM_COMPRESS)
+			len = pts_compress(buf, size);
+
+		length = len + STREAM_HEADER_SIZE;
+		if (len != size)
+			length |= STREAM_COMPRESSED;
+
+		hyper_set_be64(hdr, s->seq);
+		hyper_set_be32(hdr + STREAM_HEADER_LENGTH_OFFSET, length);
+		hyper_buf_write(buf, buf->get, hdr, sizeof(hdr));
+		buf->get += len + STREAM_HEADER_SIZE;
+		return len;
+	}
 
-			if (errno != EAGAIN && errno != EIO) {
-				perror("failed to read process's stdout/stderr");
-				pts_hup(de, efd, exec);
-				return 0;
-			}
+	pts_stream_stop(s);
+	if (size == 0) { // eof
+		pts_hup(de, hyper_epoll.efd, exec);
+	} else if (errno != EAGAIN && errno != EIO) {
+		perror("failed to read process's stdout/stderr");
+		pts_hup(de, hyper_epoll.efd, exec);
+	} else if (s->hup) {
+		pts_hup(de, hyper_epoll.efd, exec);
+	}
 
-			break;
-		}
-		fprintf(stdout, "%s: read %d data\n", __func__, size);
+	return -1;
+}
 
-		if (size == 0) { // eof
-			pts_hup(de, efd, exec);
-			return 0;
+/* fill the tty channel from the queued streams */
+void hyper_stream_schedule(struct hyper_tty *tty)
+{
+	struct hyper_buf *buf = &tty->ev.wbuf;
+	struct hyper_stream *s;
+	int size;
+
+	while (!list_empty(&tty->streams) && tty->splice_src == NULL && !FULL(buf)) {
+		s = list_first_entry(&tty->streams, struct hyper_stream, list);
+		if (s->deficit <= 0) {
+			s->deficit += STREAM_QUANTUM * s->exec->weight;
+			if (s->deficit <= 0) {
+				/* still paying for a spliced chunk */
+				list_del(&s->list);
+				list_add_tail(&s->list, &tty->streams);
+				continue;
+			}
 		}
 
-		hyper_set_be64(buf->data + buf->get, seq);
-		hyper_set_be32(buf->data + buf->get + 8, size + 12);
-		buf->get += size + 12;
-	} while (!FULL(buf));
+		size = pts_loop(s);
+		if (size < 0)
+			continue;
 
-	if (FULL(buf)) {
-		/* del & add event to move event to tail, this gives
-		 * other event a chance to write data to wbuf of tty. */
-		hyper_requeue_event(hyper_epoll.efd, de);
-	}
-out:
-	if (hyper_modify_event(hyper_epoll.efd, &hyper_epoll.tty, flag) < 0) {
-		fprintf(stderr, "modify tty event to %d failed\n", flag);
-		return -1;
+		s->deficit -= size;
+		if (s->deficit <= 0) {
+			list_del(&s->list);
+			list_add_tail(&s->list, &tty->streams);
+		}
 	}
 
-	return 0;
+	if (buf->get > 0 && hyper_modify_event(hyper_epoll.efd, &tty->ev, tty->ev.flag | EPOLLOUT) < 0)
+		fprintf(stderr, "modify tty event to %d failed\n", tty->ev.flag | EPOLLOUT);
+}
+
+/* return stdin credit to the host once half of the window is written */
+int hyper_exec_stdin_consumed(struct hyper_exec *exec, uint32_t size)
+{
+	uint8_t frame[STREAM_HEADER_SIZE + STREAM_CREDIT_ENTRY_SIZE];
+
+	if (!(hyper_epoll.features & FEATURE_STREAM_CREDIT))
+		return 0;
+
+	exec->stdin_credit += size;
+	if (exec->stdin_credit < STREAM_CREDIT_WINDOW / 2)
+		return 0;
+
+	hyper_set_be64(frame, 0);
+	hyper_set_be32(frame + STREAM_HEADER_LENGTH_OFFSET, sizeof(frame));
+	hyper_set_be64(frame + STREAM_HEADER_SIZE, exec->seq);
+	hyper_set_be32(frame + STREAM_HEADER_SIZE + 8, exec->stdin_credit);
+	exec->stdin_credit = 0;
+
+	return hyper_wbuf_append_msg(&hyper_tty_of(exec->seq)->ev, frame, sizeof(frame));
 }
 
 static int write_to_stdin(struct hyper_event *de, int efd, int events)
 {
 	struct hyper_exec *exec = container_of(de, struct hyper_exec, stdinev);
-	fprintf(stdout, "%s, seq %" PRIu64"\n", __func__, exec->seq);
+	uint32_t queued = de->wbuf.get;
+	int ret;
+	dprintf(stdout, "%s, seq %" PRIu64"\n", __func__, exec->seq);
 
-	if (hyper_event_write(de, efd, events) < 0 || (de->wbuf.get == 0 && exec->close_stdin_request))
+	ret = hyper_event_write(de, efd, events);
+	if (ret == 0)
+		hyper_exec_stdin_consumed(exec, queued - de->wbuf.get);
+
+	if (ret < 0 || (de->wbuf.get == 0 && exec->close_stdin_request))
 		pts_hup(de, efd, exec);
 
 	return 0;
@@ -162,9 +542,16 @@ struct hyper_event_ops in_ops = {
 static int stdout_loop(struct hyper_event *de, int efd, int events)
 {
 	struct hyper_exec *exec = container_of(de, struct hyper_exec, stdoutev);
-	fprintf(stdout, "%s, seq %" PRIu64"\n", __func__, exec->seq);
+	dprintf(stdout, "%s, seq %" PRIu64"\n", __func__, exec->seq);
 
-	return pts_loop(de, exec->seq, efd, exec);
+	/* edge triggered, a hup coming with the data is not reported again */
+	if (events & (EPOLLHUP | EPOLLERR))
+		exec->outstream.hup = 1;
+	if (pts_stream_hold(&exec->outstream))
+		return 0;
+	pts_stream_start(&exec->outstream);
+	hyper_stream_schedule(exec->outstream.tty);
+	return 0;
 }
 
 struct hyper_event_ops out_ops = {
@@ -177,9 +564,15 @@ struct hyper_event_ops out_ops = {
 static int stderr_loop(struct hyper_event *de, int efd, int events)
 {
 	struct hyper_exec *exec = container_of(de, struct hyper_exec, stderrev);
-	fprintf(stdout, "%s, seq %" PRIu64"\n", __func__, exec->errseq);
+	dprintf(stdout, "%s, seq %" PRIu64"\n", __func__, exec->errseq);
 
-	return pts_loop(de, exec->errseq ? exec->errseq : exec->seq, efd, exec);
+	if (events & (EPOLLHUP | EPOLLERR))
+		exec->errstream.hup = 1;
+	if (pts_stream_hold(&exec->errstream))
+		return 0;
+	pts_stream_start(&exec->errstream);
+	hyper_stream_schedule(exec->errstream.tty);
+	return 0;
 }
 
 struct hyper_event_ops err_ops = {
@@ -189,6 +582,34 @@ struct hyper_event_ops err_ops = {
 	/* don't need write buff, the stderr data is one way */
 };
 
+static int hyper_exec_has_ids(struct hyper_exec *exec)
+{
+	return (exec->user && strlen(exec->user)) || (exec->group && strlen(exec->group)) ||
+		exec->nr_additional_groups > 0;
+}
+
+/*
+ * chown the tty and switch to the looked up ids. Only syscalls, the
+ * spawn and the zygote children use it too.
+ */
+static int hyper_apply_exec_ids(struct hyper_exec *exec, struct hyper_ids *ids)
+{
+	char ptmx[32];
+
+	if (exec->tty) {
+		sprintf(ptmx, "/dev/pts/%d", exec->ptyno);
+		if (chown(ptmx, ids->uid, ids->gid) < 0)
+			return -1;
+	}
+
+	if (setgroups(ids->ngroups, ids->groups) < 0 ||
+	    setgid(ids->gid) < 0 ||
+	    setuid(ids->uid) < 0)
+		return -1;
+
+	return 0;
+}
+
 static int hyper_setup_exec_user(struct hyper_exec *exec)
 {
 	char *user = exec->user == NULL || strlen(exec->user) == 0 ? NULL : exec->user;
@@ -204,6 +625,19 @@ static int hyper_setup_exec_user(struct hyper_exec *exec)
 		return 0;
 	}
 
+	// already looked up from the cache of the container
+	if (exec->ids != NULL) {
+		if (exec->ids->user) {
+			setenv("USER", exec->ids->user, 1);
+			setenv("HOME", exec->ids->home, 1);
+		}
+		if (hyper_apply_exec_ids(exec, exec->ids) < 0) {
+			perror("apply exec user failed");
+			return -1;
+		}
+		return 0;
+	}
+
 	// get uid
 	if (user) {
 		fprintf(stdout, "try to find the user: %s\n", user);
@@ -309,8 +743,93 @@ fail:
 	return -1;
 }
 
+/*
+ * look up the user and groups of exec in the passwd files of its
+ * container, cached from the container init root. -1 if the process has
+ * to do it, e.g. for the container init itself.
+ */
+static int hyper_exec_resolve_ids(struct hyper_exec *exec, struct hyper_ids *ids)
+{
+	static struct hyper_idcache *hyperstart_ids;
+	struct hyper_idcache **ic = &hyperstart_ids;
+	struct hyper_container *c;
+	struct stat st, st1;
+	char root[64] = "/";
+
+	if (!hyper_exec_has_ids(exec))
+		return -1;
+
+	if (strcmp(exec->container_id, HYPERSTART_EXEC_CONTAINER)) {
+		c = hyper_find_container(exec->pod, exec->container_id);
+		if (c == NULL || &c->exec == exec || c->exec.pid <= 0 || c->exec.exit)
+			return -1;
+
+		ic = &c->ids;
+		if (*ic == NULL) {
+			// the init pid must still be the container init
+			sprintf(root, "/proc/%d/ns/mnt", c->exec.pid);
+			if (fstat(c->ns, &st) < 0 || stat(root, &st1) < 0 ||
+			    st.st_ino != st1.st_ino || st.st_dev != st1.st_dev)
+				return -1;
+			sprintf(root, "/proc/%d/root", c->exec.pid);
+		}
+	}
+
+	if (*ic == NULL)
+		*ic = hyper_idcache_open(root);
+	if (*ic == NULL)
+		return -1;
+
+	return hyper_idcache_resolve(*ic,
+				     exec->user && strlen(exec->user) ? exec->user : NULL,
+				     exec->group && strlen(exec->group) ? exec->group : NULL,
+				     exec->additional_groups, exec->nr_additional_groups, ids);
+}
+
+/*
+ * stdin and stdout go straight to the dedicated channel, no event for them.
+ * It was connected by hyper_exec_connect().
+ */
+static int hyper_setup_stdio_datachannel(struct hyper_exec *e, struct stdio_config *io)
+{
+	int fd = e->datafd;
+	if (fd < 0)
+		return -1;
+
+	e->datafd = -1;
+	io->stdinfd = fd;
+	io->stdoutfd = dup(fd);
+	if (io->stdoutfd < 0) {
+		perror("dup data channel failed");
+		return -1;
+	}
+
+	if (e->errseq == 0) {
+		io->stderrfd = dup(fd);
+		if (io->stderrfd < 0) {
+			perror("dup data channel failed");
+			return -1;
+		}
+		return 0;
+	}
+
+	int errpipe[2];
+	if (pipe2(errpipe, O_CLOEXEC) < 0) {
+		fprintf(stderr, "creating stderr pipe failed\n");
+		return -1;
+	}
+	hyper_setfd_nonblock(errpipe[0]);
+	io->stderrevfd = errpipe[0];
+	io->stderrfd = errpipe[1];
+
+	return 0;
+}
+
 static int hyper_setup_stdio_notty(struct hyper_exec *e, struct stdio_config *io)
 {
+	if (e->datachannel)
+		return hyper_setup_stdio_datachannel(e, io);
+
 	if (e->errseq == 0)
 		return -1;
 
@@ -354,6 +873,9 @@ static int hyper_setup_stdio(struct hyper_exec *e, struct stdio_config *io)
 		return hyper_setup_stdio_notty(e, io);
 	}
 
+	if (e->datachannel)
+		fprintf(stdout, "exec with terminal, ignore data channel %s\n", e->datachannel);
+
 	if (e->errseq > 0) {
 		int errpipe[2];
 		if (pipe2(errpipe, O_CLOEXEC) < 0) {
@@ -392,56 +914,64 @@ static int hyper_setup_stdio(struct hyper_exec *e, struct stdio_config *io)
 	return 0;
 }
 
-static int hyper_install_process_stdio(struct hyper_exec *e, struct stdio_config *io)
+/*
+ * open the pty slave and dup the stdio to 0, 1 and 2. Only syscalls and
+ * nothing written to memory, the vfork child of the spawn path uses it too.
+ */
+static int hyper_dup_process_stdio(struct hyper_exec *e, struct stdio_config *io)
 {
-	int ret = -1;
-
-	fprintf(stdout, "%s\n", __func__);
+	int stdinfd = io->stdinfd, stdoutfd = io->stdoutfd, stderrfd = io->stderrfd;
 
 	if (e->tty) {
-		char ptmx[512];
+		char ptmx[32];
 		int ptyslave;
 
 		sprintf(ptmx, "/dev/pts/%d", e->ptyno);
 		ptyslave = open(ptmx, O_RDWR | O_CLOEXEC);
-		if (ptyslave < 0 || ioctl(ptyslave, TIOCSCTTY, NULL) < 0) {
-			perror("ioctl pty device for execcmd failed");
-			goto out;
-		}
-		io->stdinfd = ptyslave;
-		io->stdoutfd = ptyslave;
+		if (ptyslave < 0 || ioctl(ptyslave, TIOCSCTTY, NULL) < 0)
+			return -1;
+		stdinfd = ptyslave;
+		stdoutfd = ptyslave;
 		if (e->errseq == 0)
-			io->stderrfd = ptyslave;
+			stderrfd = ptyslave;
 	}
 
-	fflush(NULL);
+	/*
+	 * we are going to exec, all of the io->stdinfd, io->stdoutfd and
+	 * io->stderrfd are O_CLOEXEC, we don't need to close them explicitly
+	 */
+	if (dup2(stdinfd, STDIN_FILENO) < 0 ||
+	    dup2(stdoutfd, STDOUT_FILENO) < 0 ||
+	    dup2(stderrfd, STDERR_FILENO) < 0)
+		return -1;
 
-	if (dup2(io->stdinfd, STDIN_FILENO) < 0) {
-		perror("dup tty device to stdin failed");
-		goto out;
-	}
+	return 0;
+}
 
-	if (dup2(io->stdoutfd, STDOUT_FILENO) < 0) {
-		perror("dup tty device to stdout failed");
-		goto out;
-	}
+static int hyper_install_process_stdio(struct hyper_exec *e, struct stdio_config *io)
+{
+	fprintf(stdout, "%s\n", __func__);
+	fflush(NULL);
 
-	if (dup2(io->stderrfd, STDERR_FILENO) < 0) {
-		perror("dup err pipe to stderr failed");
-		goto out;
+	if (hyper_dup_process_stdio(e, io) < 0) {
+		perror("install process stdio failed");
+		return -1;
 	}
 
-	/*
-	 * we are going to execvp(), all of the io->stdinfd, io->stdoutfd and
-	 * io->stderrfd are O_CLOEXEC, we don't need to close them explicitly
-	 */
-	ret = 0;
-out:
-	return ret;
+	return 0;
 }
 
 static int hyper_setup_stdio_events(struct hyper_exec *exec, struct stdio_config *io)
 {
+	if (exec->weight <= 0)
+		exec->weight = 1;
+	else if (exec->weight > STREAM_MAX_WEIGHT)
+		exec->weight = STREAM_MAX_WEIGHT;
+
+	// output is only held if the exec asked for it
+	if (exec->coalesce <= STREAM_COALESCE_DEFAULT || exec->coalesce >= STREAM_COALESCE_MAX)
+		exec->coalesce = STREAM_COALESCE_NONE;
+
 	if (exec->tty) {
 		io->stdinevfd = dup(exec->ptyfd);
 		io->stdoutevfd = dup(exec->ptyfd);
@@ -450,6 +980,10 @@ static int hyper_setup_stdio_events(struct hyper_exec *exec, struct stdio_config
 		}
 	}
 
+	// stdio on a data channel has no event
+	if (io->stdinevfd < 0)
+		goto setup_stdout;
+
 	fprintf(stdout, "hyper_init_event exec stdin event %p, ops %p, fd %d\n",
 		&exec->stdinev, &in_ops, io->stdinevfd);
 	exec->stdinev.fd = io->stdinevfd;
@@ -460,21 +994,32 @@ static int hyper_setup_stdio_events(struct hyper_exec *exec, struct stdio_config
 	}
 	exec->ref++;
 
+setup_stdout:
+	if (io->stdoutevfd < 0)
+		goto setup_stderr;
+
 	fprintf(stdout, "hyper_init_event exec stdout event %p, ops %p, fd %d\n",
 		&exec->stdoutev, &out_ops, io->stdoutevfd);
 	exec->stdoutev.fd = io->stdoutevfd;
+	pts_stream_init(&exec->outstream, &exec->stdoutev, exec, exec->seq);
 	if (hyper_init_event(&exec->stdoutev, &out_ops, NULL) < 0 ||
-	    hyper_add_event(hyper_epoll.efd, &exec->stdoutev, EPOLLIN) < 0) {
+	    hyper_add_event(hyper_epoll.efd, &exec->stdoutev, EPOLLIN | EPOLLET) < 0) {
 		fprintf(stderr, "add container stdout event failed\n");
 		return -1;
 	}
 	exec->ref++;
 
+setup_stderr:
+	if (io->stderrevfd < 0)
+		return 0;
+
 	fprintf(stdout, "hyper_init_event exec stderr event %p, ops %p, fd %d\n",
 		&exec->stderrev, &err_ops, io->stderrevfd);
 	exec->stderrev.fd = io->stderrevfd;
+	pts_stream_init(&exec->errstream, &exec->stderrev, exec,
+			exec->errseq ? exec->errseq : exec->seq);
 	if (hyper_init_event(&exec->stderrev, &err_ops, NULL) < 0 ||
-	    hyper_add_event(hyper_epoll.efd, &exec->stderrev, EPOLLIN) < 0) {
+	    hyper_add_event(hyper_epoll.efd, &exec->stderrev, EPOLLIN | EPOLLET) < 0) {
 		fprintf(stderr, "add container stderr event failed\n");
 		return -1;
 	}
@@ -581,19 +1126,33 @@ exit:
 	_exit(125);
 }
 
-static void hyper_free_exec(struct hyper_exec *exec)
+static void hyper_destroy_exec(struct hyper_exec *exec)
 {
-	hyper_cleanup_exec(exec);
-	free(exec);
+	hyper_timer_del(&exec->timer);
+	hyper_free_exec(exec);
 }
 
-int hyper_exec_cmd(struct hyper_pod *pod, char *json, int length)
+static void hyper_exec_cmd_done(struct hyper_exec *exec, int ret, void *data)
 {
-	struct hyper_exec *exec;
+	if (ret < 0)
+		hyper_destroy_exec(exec);
+
+	hyper_ctl_complete(data, ret, NULL, 0);
+}
 
-	fprintf(stdout, "call hyper_exec_cmd, json %s, len %d\n", json, length);
+int hyper_exec_cmd(struct hyper_pod *pod, char *data, int length)
+{
+	struct hyper_ctl_request *req;
+	struct hyper_container *c;
+	struct hyper_exec *exec;
 
-	exec = hyper_parse_execcmd(json, length);
+	if (hyper_epoll.features & FEATURE_BINARY_CMD) {
+		fprintf(stdout, "call hyper_exec_cmd, binary, len %d\n", length);
+		exec = hyper_parse_execcmd_tlv((uint8_t *)data, length);
+	} else {
+		fprintf(stdout, "call hyper_exec_cmd, json %s, len %d\n", data, length);
+		exec = hyper_parse_execcmd(data, length);
+	}
 	if (exec == NULL) {
 		fprintf(stderr, "parse exec cmd failed\n");
 		return -1;
@@ -601,41 +1160,1436 @@ int hyper_exec_cmd(struct hyper_pod *pod, char *json, int length)
 
 	if (!hyper_has_container(pod, exec->container_id)) {
 		fprintf(stderr, "call hyper_exec_cmd, no such container: %s\n", exec->container_id);
-		hyper_free_exec(exec);
+		hyper_destroy_exec(exec);
+		return -1;
+	}
+
+	c = hyper_find_container(pod, exec->container_id);
+	if (c != NULL && c->setup != NULL) {
+		fprintf(stderr, "call hyper_exec_cmd, container %s is being set up\n", exec->container_id);
+		hyper_destroy_exec(exec);
 		return -1;
 	}
-	if (hyper_find_exec_by_name(pod, exec->id) != NULL) {
+	if (hyper_find_exec_by_name(pod, exec->id) != NULL ||
+	    hyper_find_launching(pod, exec->id) != NULL) {
 		fprintf(stderr, "call hyper_exec_cmd, process id conflicts");
-		hyper_free_exec(exec);
+		hyper_destroy_exec(exec);
 		return -1;
 	}
 
-	exec->pod = pod;
-	int ret = hyper_run_process(exec);
-	if (ret < 0) {
-		hyper_free_exec(exec);
+	/* replied once the pid arrives */
+	req = hyper_ctl_defer();
+	if (req == NULL) {
+		hyper_destroy_exec(exec);
+		return -1;
 	}
-	return ret;
+
+	exec->pod = pod;
+	if (hyper_run_process(exec, hyper_exec_cmd_done, req) < 0)
+		hyper_exec_cmd_done(exec, -1, req);
+
+	return 0;
+}
+
+/*
+ * A process is launched in the background: the helper forked for it
+ * reports the pid on a pipe watched by the event loop, and the launch is
+ * finished from there. Other commands and stdio go on meanwhile.
+ */
+struct hyper_exec_launch {
+	struct list_head	list;
+	struct hyper_event	ev;
+	struct hyper_exec	*exec;
+	struct stdio_config	io;
+	hyper_exec_done		done;
+	void			*data;
+	int			helper;	// forked in between, its exit is not the process's
+	uint64_t		gen;
+};
+
+static LIST_HEAD(hyper_launching);
+static uint64_t hyper_launch_gen;
+static struct hyper_pool hyper_launch_pool = HYPER_POOL(sizeof(struct hyper_exec_launch), 8);
+
+/*
+ * the process may exit and get reaped before its pid arrives, every exit
+ * of an unknown pid is kept for that while launches are pending, none may
+ * be lost or the exec never reports its exit. An exit counts for a launch
+ * only if it was reaped after the launch began, a pid recorded earlier may
+ * be reused by now.
+ */
+struct hyper_exit_record {
+	int		pid;
+	uint8_t		code;
+	uint64_t	gen;	// the latest launch when reaped
+};
+
+static struct hyper_exit_record *exit_history;
+static int exit_history_num;
+static int exit_history_size;
+
+static void hyper_exit_history_add(int pid, uint8_t code)
+{
+	struct hyper_exec_launch *launch;
+	struct hyper_exit_record *r;
+	int size;
+
+	list_for_each_entry(launch, &hyper_launching, list) {
+		if (launch->helper == pid)
+			return;
+	}
+
+	if (exit_history_num == exit_history_size) {
+		size = exit_history_size ? exit_history_size * 2 : 64;
+		r = realloc(exit_history, size * sizeof(*r));
+		if (r == NULL) {
+			fprintf(stderr, "no room to record the exit of pid %d\n", pid);
+			return;
+		}
+		exit_history = r;
+		exit_history_size = size;
+	}
+
+	r = &exit_history[exit_history_num++];
+	r->pid = pid;
+	r->code = code;
+	r->gen = hyper_launch_gen;
+}
+
+static void hyper_exit_history_clear(void)
+{
+	free(exit_history);
+	exit_history = NULL;
+	exit_history_num = 0;
+	exit_history_size = 0;
+}
+
+static int hyper_exit_history_take(int pid, uint64_t gen, uint8_t *code)
+{
+	int i;
+
+	// the earliest one, the pid can't be reused before our process is reaped
+	for (i = 0; i < exit_history_num; i++) {
+		if (exit_history[i].pid != pid || exit_history[i].gen < gen)
+			continue;
+
+		*code = exit_history[i].code;
+		exit_history_num--;
+		memmove(&exit_history[i], &exit_history[i + 1],
+			(exit_history_num - i) * sizeof(*exit_history));
+		return 1;
+	}
+
+	return 0;
+}
+
+/* exec_head and its indexes, the pid and the seq of exec are set */
+static void hyper_exec_link(struct hyper_exec *exec)
+{
+	struct hyper_pod *pod = exec->pod;
+
+	list_add_tail(&exec->list, &pod->exec_head);
+	hlist_add_head(&exec->seq_node,
+		       &pod->exec_seq_hash[hyper_hash_64(exec->seq, HYPER_EXEC_HASH_BITS)]);
+	hlist_add_head(&exec->pid_node,
+		       &pod->exec_pid_hash[hyper_hash_64(exec->pid, HYPER_EXEC_HASH_BITS)]);
+	hlist_add_head(&exec->id_node,
+		       &pod->exec_id_hash[hyper_hash_str(exec->id ? exec->id : "", HYPER_EXEC_HASH_BITS)]);
+}
+
+static void hyper_exec_unlink(struct hyper_exec *exec)
+{
+	list_del_init(&exec->list);
+	hlist_del_init(&exec->seq_node);
+	hlist_del_init(&exec->pid_node);
+	hlist_del_init(&exec->id_node);
+}
+
+/*
+ * the pid of exec is known, launch is NULL if it was cloned right here and
+ * no exit of it can have been reaped yet.
+ */
+static int hyper_exec_launched(struct hyper_exec *exec, struct stdio_config *io, int pid,
+			       struct hyper_exec_launch *launch)
+{
+	uint8_t code;
+
+	if (hyper_setup_stdio_events(exec, io) < 0) {
+		fprintf(stderr, "add pts master event failed\n");
+		return -1;
+	}
+
+	exec->pid = pid;
+	hyper_exec_link(exec);
+	exec->ref++;
+	fprintf(stdout, "%s process pid %d\n", __func__, exec->pid);
+
+	// already reaped, its pid may be reused, don't open a pidfd for it
+	if (launch != NULL && exec->zygote == NULL &&
+	    hyper_exit_history_take(pid, launch->gen, &code)) {
+		hyper_exec_exited(exec, code);
+		return 0;
+	}
+
+	// the zygote reports the exits of its children
+	if (exec->zygote == NULL)
+		hyper_exec_track_pid(exec);
+	if (exec->timeout)
+		hyper_timer_add(&exec->timer, exec->timeout, hyper_exec_timeout);
+	return 0;
+}
+
+static void hyper_exec_launch_close(struct hyper_exec *exec, struct stdio_config *io)
+{
+	hyper_reset_event(&exec->stdinev);
+	hyper_reset_event(&exec->stdoutev);
+	hyper_reset_event(&exec->stderrev);
+	hyper_exec_unlink(exec);
+	exec->zygote = NULL;
+
+	if (exec->sigfd >= 0) {
+		close(exec->sigfd);
+		exec->sigfd = -1;
+	}
+	close(exec->ptyfd);
+	exec->ptyfd = -1;
+	close(io->stdinevfd);
+	close(io->stdoutevfd);
+	close(io->stderrevfd);
+}
+
+/* the pid of the launch arrived, -1 if the process didn't start */
+static void hyper_exec_launch_finish(struct hyper_exec_launch *launch, int pid)
+{
+	struct hyper_exec *exec = launch->exec;
+	int ret = -1;
+
+	if (pid <= 0)
+		fprintf(stderr, "run process failed\n");
+	else if (hyper_exec_launched(exec, &launch->io, pid, launch) == 0)
+		ret = 0;
+
+	if (ret < 0)
+		hyper_exec_launch_close(exec, &launch->io);
+
+	hyper_reset_event(&launch->ev);
+	list_del(&launch->list);
+	if (list_empty(&hyper_launching))
+		hyper_exit_history_clear();
+	launch->done(exec, ret, launch->data);
+	hyper_pool_free(&hyper_launch_pool, launch);
+}
+
+static int hyper_exec_launch_read(struct hyper_event *he, int efd, int events)
+{
+	struct hyper_exec_launch *launch = container_of(he, struct hyper_exec_launch, ev);
+	uint32_t type;
+
+	// eof if the helper failed before it got to the pid
+	if (hyper_get_type(he->fd, &type) < 0)
+		type = -1;
+
+	hyper_exec_launch_finish(launch, (int)type);
+	return 0;
+}
+
+static void hyper_exec_launch_hup(struct hyper_event *he, int efd)
+{
+	hyper_exec_launch_read(he, efd, 0);
+}
+
+static struct hyper_event_ops launch_ops = {
+	.read		= hyper_exec_launch_read,
+	.hup		= hyper_exec_launch_hup,
+};
+
+/* exec being launched with the process id, if any */
+static struct hyper_exec *hyper_find_launching(struct hyper_pod *pod, const char *process)
+{
+	struct hyper_exec_launch *launch;
+
+	list_for_each_entry(launch, &hyper_launching, list) {
+		if (launch->exec->pod == pod && strcmp(launch->exec->id, process) == 0)
+			return launch->exec;
+	}
+
+	return NULL;
+}
+
+static int hyper_exec_connect_write(struct hyper_event *he, int efd, int events)
+{
+	struct hyper_exec_launch *launch = container_of(he, struct hyper_exec_launch, ev);
+	struct hyper_exec *exec = launch->exec;
+	hyper_exec_done done = launch->done;
+	void *data = launch->data;
+	int fd = -1;
+
+	if (hyper_transport_connected(he->fd) == 0) {
+		fd = fcntl(he->fd, F_DUPFD_CLOEXEC, 0);
+		if (fd < 0)
+			perror("dup data channel failed");
+	}
+
+	hyper_reset_event(he);
+	list_del(&launch->list);
+	hyper_pool_free(&hyper_launch_pool, launch);
+
+	if (fd < 0) {
+		done(exec, -1, data);
+		return 0;
+	}
+
+	exec->datafd = fd;
+	if (hyper_run_process(exec, done, data) < 0)
+		done(exec, -1, data);
+	return 0;
+}
+
+static void hyper_exec_connect_hup(struct hyper_event *he, int efd)
+{
+	hyper_exec_connect_write(he, efd, 0);
+}
+
+static struct hyper_event_ops connect_ops = {
+	.write		= hyper_exec_connect_write,
+	.hup		= hyper_exec_connect_hup,
+};
+
+/*
+ * connect the data channel of exec without blocking the loop. It is on
+ * hyper_launching meanwhile, and hyper_run_process() goes on once the
+ * channel is connected. Returns as hyper_run_process().
+ */
+static int hyper_exec_connect(struct hyper_exec *exec, hyper_exec_done done, void *data)
+{
+	struct hyper_exec_launch *launch;
+	int fd, pending;
+
+	fd = hyper_transport_connect(exec->datachannel, &pending);
+	if (fd < 0)
+		return -1;
+
+	if (!pending) {
+		exec->datafd = fd;
+		return hyper_run_process(exec, done, data);
+	}
+
+	launch = hyper_pool_zalloc(&hyper_launch_pool);
+	if (launch == NULL) {
+		fprintf(stderr, "allocate exec launch failed\n");
+		close(fd);
+		return -1;
+	}
+
+	launch->ev.fd = fd;
+	if (hyper_init_event(&launch->ev, &connect_ops, NULL) < 0 ||
+	    hyper_add_event(hyper_epoll.efd, &launch->ev, EPOLLOUT) < 0) {
+		fprintf(stderr, "add data channel event failed\n");
+		hyper_reset_event(&launch->ev);
+		hyper_pool_free(&hyper_launch_pool, launch);
+		return -1;
+	}
+
+	launch->exec = exec;
+	launch->done = done;
+	launch->data = data;
+	list_add_tail(&launch->list, &hyper_launching);
+	return 0;
+}
+
+/*
+ * The spawn path of hyper_run_process. The process is cloned with
+ * CLONE_VM | CLONE_VFORK straight into the pod pid namespace, set as the
+ * pid namespace for our children with the fd cached at pod start, so
+ * there is neither a copy of hyperstart nor a helper process. The child
+ * borrows our memory and stack until it execs. It only makes syscalls on
+ * what is prepared here, envp included, and reports failures in struct
+ * hyper_spawn. Without the user and groups looked up from the cache of
+ * the container the process takes the fork path. Its stack is mapped
+ * once with a guard page below, nothing sized by the request goes on it.
+ */
+#define HYPER_SPAWN_STACK	(64 << 10)
+
+struct hyper_spawn {
+	struct hyper_exec	*exec;
+	struct hyper_container	*c;	// NULL for the hyperstart container
+	struct stdio_config	*io;
+	char			**envp;
+	int			envc;
+	const char		*path;
+	const char		*cwd;	// container workdir, relative to its root
+	/* argv of /bin/sh if the file turns out to be a script */
+	char			**sh;
+	/* what the child failed at before exec, it exits with 125 */
+	const char		*failed;
+	int			err;
+};
+
+static int hyper_spawn_setenv(struct hyper_spawn *s, const char *name, const char *value)
+{
+	size_t len = strlen(name);
+	char **envp;
+	char *env;
+	int i;
+
+	if (len == 0 || strchr(name, '=') != NULL || value == NULL)
+		return -1;
+
+	env = malloc(len + strlen(value) + 2);
+	if (env == NULL)
+		return -1;
+	sprintf(env, "%s=%s", name, value);
+
+	for (i = 0; i < s->envc; i++) {
+		if (!strncmp(s->envp[i], name, len) && s->envp[i][len] == '=') {
+			free(s->envp[i]);
+			s->envp[i] = env;
+			return 0;
+		}
+	}
+
+	envp = realloc(s->envp, (s->envc + 2) * sizeof(*envp));
+	if (envp == NULL) {
+		free(env);
+		return -1;
+	}
+	envp[s->envc++] = env;
+	envp[s->envc] = NULL;
+	s->envp = envp;
+	return 0;
+}
+
+static void hyper_spawn_unsetenv(struct hyper_spawn *s, const char *name)
+{
+	size_t len = strlen(name);
+	int i;
+
+	for (i = 0; i < s->envc; i++) {
+		if (!strncmp(s->envp[i], name, len) && s->envp[i][len] == '=') {
+			free(s->envp[i]);
+			s->envp[i] = s->envp[--s->envc];
+			s->envp[s->envc] = NULL;
+			return;
+		}
+	}
+}
+
+static void hyper_spawn_free_envp(struct hyper_spawn *s)
+{
+	int i;
+
+	for (i = 0; i < s->envc; i++)
+		free(s->envp[i]);
+	free(s->envp);
+	free(s->sh);
+}
+
+/* argv of /bin/sh for a script, the file is filled in once it is found */
+static int hyper_spawn_prepare_script(struct hyper_spawn *s)
+{
+	char **argv = s->exec->argv;
+	int argc = 0;
+
+	while (argv[argc] != NULL)
+		argc++;
+
+	s->sh = calloc(argc + 2, sizeof(*s->sh));
+	if (s->sh == NULL)
+		return -1;
+
+	s->sh[0] = "/bin/sh";
+	if (argc > 0)
+		memcpy(s->sh + 2, argv + 1, argc * sizeof(*s->sh));
+	return 0;
+}
+
+/*
+ * the environment the fork path ends up with after its setenv calls, and
+ * the PATH and the workdir of the container to start in.
+ */
+static int hyper_spawn_prepare(struct hyper_spawn *s)
+{
+	struct hyper_exec *exec = s->exec;
+	char **env;
+	int i;
+
+	for (env = environ; *env != NULL; env++) {
+		char *eq = strchr(*env, '=');
+
+		if (eq == NULL)
+			continue;
+		*eq = '\0';
+		i = hyper_spawn_setenv(s, *env, eq + 1);
+		*eq = '=';
+		if (i < 0)
+			return -1;
+	}
+
+	if (s->c != NULL) {
+		if (hyper_spawn_setenv(s, "HOME", "/root") < 0 ||
+		    hyper_spawn_setenv(s, "HOSTNAME", exec->pod->hostname) < 0)
+			return -1;
+		if (exec->tty && hyper_spawn_setenv(s, "TERM", "xterm") < 0)
+			return -1;
+		if (!exec->tty)
+			hyper_spawn_unsetenv(s, "TERM");
+
+		for (i = 0; !exec->init && i < s->c->exec.envs_num; i++) {
+			if (hyper_spawn_setenv(s, s->c->exec.envs[i].env, s->c->exec.envs[i].value) < 0)
+				return -1;
+		}
+		if (!exec->init)
+			s->cwd = s->c->exec.workdir;
+	}
+
+	if (exec->ids != NULL && exec->ids->user != NULL &&
+	    (hyper_spawn_setenv(s, "USER", exec->ids->user) < 0 ||
+	     hyper_spawn_setenv(s, "HOME", exec->ids->home) < 0))
+		return -1;
+
+	for (i = 0; i < exec->envs_num; i++) {
+		if (hyper_spawn_setenv(s, exec->envs[i].env, exec->envs[i].value) < 0)
+			return -1;
+	}
+
+	s->path = "/bin:/usr/bin";
+	for (i = 0; i < s->envc; i++) {
+		if (!strncmp(s->envp[i], "PATH=", 5))
+			s->path = s->envp[i] + 5;
+	}
+
+	return hyper_spawn_prepare_script(s);
+}
+
+/* a file without a known executable format is a script for /bin/sh */
+static void hyper_spawn_script(struct hyper_spawn *s, char *file)
+{
+	if (s->sh == NULL)
+		return;
+
+	s->sh[1] = file;
+	execve(s->sh[0], s->sh, s->envp);
+}
+
+/* execvp() with the prebuilt envp, PATH is searched in the container */
+static void hyper_spawn_exec(struct hyper_spawn *s)
+{
+	char **argv = s->exec->argv;
+	const char *dir = s->path, *end;
+	size_t len = strlen(argv[0]);
+	char file[PATH_MAX];
+	int eacces = 0;
+
+	if (len == 0) {
+		errno = ENOENT;
+		return;
+	}
+
+	if (strchr(argv[0], '/') != NULL) {
+		execve(argv[0], argv, s->envp);
+		if (errno == ENOEXEC)
+			hyper_spawn_script(s, argv[0]);
+		return;
+	}
+
+	for (;; dir = end + 1) {
+		end = strchrnul(dir, ':');
+		if (end - dir + len + 2 <= sizeof(file)) {
+			// an empty entry is the current directory
+			memcpy(file, dir, end - dir);
+			file[end - dir] = '/';
+			memcpy(file + (end - dir) + (end > dir), argv[0], len + 1);
+
+			execve(file, argv, s->envp);
+			switch (errno) {
+			case ENOEXEC:
+				hyper_spawn_script(s, file);
+				return;
+			case EACCES:
+				eacces = 1;
+				/* fall through */
+			case ENOENT:
+			case ENOTDIR:
+			case ESTALE:
+			case ENODEV:
+			case ETIMEDOUT:
+				break;
+			default:
+				return;
+			}
+		}
+		if (*end == '\0')
+			break;
+	}
+
+	errno = eacces ? EACCES : ENOENT;
+}
+
+static int hyper_spawn_child(void *data)
+{
+	struct hyper_spawn *s = data;
+	struct hyper_exec *exec = s->exec;
+	struct hyper_pod *pod = exec->pod;
+	struct iovec iov[3];
+	int err;
+
+	if (sigprocmask(SIG_SETMASK, &orig_mask, NULL) < 0) {
+		s->failed = "restore sigmask";
+		goto fail;
+	}
+
+	if (s->c != NULL) {
+		if (setns(pod->utsns, CLONE_NEWUTS) < 0 ||
+		    setns(pod->ipcns, CLONE_NEWIPC) < 0 ||
+		    setns(s->c->ns, CLONE_NEWNS) < 0) {
+			s->failed = "enter the sandbox";
+			goto fail;
+		}
+		if (chdir("/") < 0) {
+			s->failed = "enter container root";
+			goto fail;
+		}
+	}
+
+	if (s->cwd && chdir(s->cwd) < 0) {
+		s->failed = "enter container workdir";
+		goto fail;
+	}
+
+	if (exec->workdir && chdir(exec->workdir) < 0) {
+		s->failed = "change work directory";
+		goto fail;
+	}
+
+	if (exec->ids != NULL && hyper_apply_exec_ids(exec, exec->ids) < 0) {
+		s->failed = "set exec user";
+		goto fail;
+	}
+
+	setsid();
+
+	if (hyper_dup_process_stdio(exec, s->io) < 0) {
+		s->failed = "install process stdio";
+		goto fail;
+	}
+
+	hyper_spawn_exec(s);
+
+	// perror of the fork path, the process stderr gets it
+	err = errno;
+	iov[0].iov_base = "exec failed: ";
+	iov[0].iov_len = strlen(iov[0].iov_base);
+	iov[1].iov_base = strerror(err);
+	iov[1].iov_len = strlen(iov[1].iov_base);
+	iov[2].iov_base = "\n";
+	iov[2].iov_len = 1;
+	writev(STDERR_FILENO, iov, 3);
+
+	s->failed = "exec";
+	s->err = err;
+	_exit(err == ENOENT ? 127 : err == EACCES ? 126 : 125);
+fail:
+	s->err = errno;
+	_exit(125);
+}
+
+/* our own pid namespace, restored once a process is cloned into the pod */
+static int hyper_self_pidns(void)
+{
+	static int pidns = -1;
+
+	if (pidns < 0)
+		pidns = open("/proc/self/ns/pid", O_RDONLY | O_CLOEXEC);
+	return pidns;
+}
+
+/* top of the stack of the spawned child, NULL if it can't be mapped */
+static char *hyper_spawn_stack(void)
+{
+	static char *top;
+	long page = sysconf(_SC_PAGESIZE);
+	char *p;
+
+	if (top != NULL)
+		return top;
+
+	p = mmap(NULL, HYPER_SPAWN_STACK + page, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+	if (p == MAP_FAILED) {
+		perror("map spawn stack failed");
+		return NULL;
+	}
+
+	// an overflow faults the child instead of corrupting our memory
+	if (mprotect(p, page, PROT_NONE) < 0) {
+		perror("protect spawn stack guard failed");
+		munmap(p, HYPER_SPAWN_STACK + page);
+		return NULL;
+	}
+
+	top = p + page + HYPER_SPAWN_STACK;
+	return top;
+}
+
+/* set once our pid namespace could not be restored, see below */
+static int hyper_spawn_off;
+
+/*
+ * returns the pid, 0 if the process has to take the fork path, -1 if the
+ * launch failed
+ */
+static int hyper_spawn_process(struct hyper_exec *exec, struct stdio_config *io)
+{
+	char *stack = hyper_spawn_stack();
+	struct hyper_pod *pod = exec->pod;
+	struct hyper_spawn s = {
+		.exec	= exec,
+		.io	= io,
+	};
+	int pid = 0;
+
+	if (hyper_spawn_off || stack == NULL || (hyper_exec_has_ids(exec) && exec->ids == NULL))
+		return 0;
+
+	if (strcmp(exec->container_id, HYPERSTART_EXEC_CONTAINER)) {
+		s.c = hyper_find_container(pod, exec->container_id);
+		if (s.c == NULL || pod->pidns < 0 || hyper_self_pidns() < 0)
+			return 0;
+	}
+
+	if (hyper_spawn_prepare(&s) < 0) {
+		fprintf(stderr, "prepare exec envs failed, fork the process\n");
+		goto out;
+	}
+
+	if (s.c != NULL && setns(pod->pidns, CLONE_NEWPID) < 0) {
+		perror("enter pidns of pod init failed");
+		goto out;
+	}
+
+	pid = clone(hyper_spawn_child, stack, CLONE_VM | CLONE_VFORK | SIGCHLD, &s);
+	if (pid < 0) {
+		perror("spawn exec process failed");
+		pid = 0;
+	}
+
+	// the children to come belong to our own pid namespace again
+	if (s.c != NULL && setns(hyper_self_pidns(), CLONE_NEWPID) < 0) {
+		perror("restore pidns failed, turn off the spawn path");
+		hyper_spawn_off = 1;
+		if (pid > 0)
+			kill(pid, SIGKILL);
+		pid = -1;
+		goto out;
+	}
+
+	if (pid > 0 && s.failed != NULL)
+		fprintf(stderr, "exec process %d failed to %s: %s\n", pid, s.failed, strerror(s.err));
+out:
+	hyper_spawn_free_envp(&s);
+	return pid;
+}
+
+/*
+ * A zygote is a long-lived helper of the container, started at its first
+ * exec if the container asks for it with "zygote": true. It has entered
+ * the pod pid, uts and ipc namespaces and the container mount namespace
+ * once, and forks the later processes of the container from there. A
+ * request carries what the spawn path prepares, with the stdio fds in
+ * SCM_RIGHTS. The zygote answers with the pid in SCM_CREDENTIALS, which
+ * the kernel translates to our pid namespace, and a pidfd of the child in
+ * SCM_RIGHTS if it has one, which we use to signal it. It reports the
+ * exits of its children with their pids. Its children are not ours to reap.
+ */
+#define ZYGOTE_MSG_MAX		65536
+
+#define ZYGOTE_SPAWNED		1
+#define ZYGOTE_EXITED		2
+
+struct hyper_zygote {
+	struct hyper_event	ev;
+	struct hyper_container	*c;
+	struct hyper_pod	*pod;
+	int			pid;
+	int			stopping;
+};
+
+/*
+ * the supplementary gids follow, then argv, envp, PATH, the container
+ * and the exec workdir as strings
+ */
+struct hyper_zygote_req {
+	uint64_t	seq;
+	int32_t		tty;
+	int32_t		ptyno;
+	int32_t		errseq;	// stderr has its own stream
+	uint32_t	argc;
+	uint32_t	envc;
+	uint32_t	fds;	// which of stdin, stdout and stderr are passed
+	int32_t		ids;	// switch to the ids below
+	uint32_t	uid;
+	uint32_t	gid;
+	uint32_t	ngroups;
+};
+
+struct hyper_zygote_msg {
+	uint32_t	type;
+	int32_t		code;	// exit code, or -errno if the fork failed
+	uint64_t	seq;
+};
+
+/* pidfd of the child is passed along if it is not -1 */
+static int hyper_zygote_send(int fd, uint32_t type, int code, uint64_t seq, int pid, int pidfd)
+{
+	struct hyper_zygote_msg msg = {
+		.type	= type,
+		.code	= code,
+		.seq	= seq,
+	};
+	struct ucred cred = {
+		.pid	= pid,
+		.uid	= getuid(),
+		.gid	= getgid(),
+	};
+	char cbuf[CMSG_SPACE(sizeof(cred)) + CMSG_SPACE(sizeof(int))]
+		__attribute__((aligned(8)));
+	struct iovec iov = {
+		.iov_base	= &msg,
+		.iov_len	= sizeof(msg),
+	};
+	struct msghdr mh = {
+		.msg_iov	= &iov,
+		.msg_iovlen	= 1,
+		.msg_control	= cbuf,
+		.msg_controllen	= CMSG_SPACE(sizeof(cred)),
+	};
+	struct cmsghdr *cmsg;
+
+	memset(cbuf, 0, sizeof(cbuf));
+	if (pidfd >= 0)
+		mh.msg_controllen = sizeof(cbuf);
+
+	cmsg = CMSG_FIRSTHDR(&mh);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_CREDENTIALS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(cred));
+	memcpy(CMSG_DATA(cmsg), &cred, sizeof(cred));
+
+	if (pidfd >= 0) {
+		cmsg = CMSG_NXTHDR(&mh, cmsg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &pidfd, sizeof(int));
+	}
+
+	return sendmsg(fd, &mh, MSG_NOSIGNAL);
+}
+
+/* next string of the request, NULL if it runs past the end */
+static char *hyper_zygote_string(char **p, char *end)
+{
+	char *s = *p, *nul;
+
+	if (s >= end || (nul = memchr(s, '\0', end - s)) == NULL)
+		return NULL;
+
+	*p = nul + 1;
+	return s;
+}
+
+/* returns 0 once we are told to stop */
+static int hyper_zygote_recv(int fd)
+{
+	static char buf[ZYGOTE_MSG_MAX] __attribute__((aligned(8)));
+	struct hyper_zygote_req *req = (struct hyper_zygote_req *)buf;
+	char cbuf[CMSG_SPACE(3 * sizeof(int))], *p, *end;
+	struct iovec iov = {
+		.iov_base	= buf,
+		.iov_len	= sizeof(buf),
+	};
+	struct msghdr mh = {
+		.msg_iov	= &iov,
+		.msg_iovlen	= 1,
+		.msg_control	= cbuf,
+		.msg_controllen	= sizeof(cbuf),
+	};
+	struct cmsghdr *cmsg;
+	struct stdio_config io = {-1, -1, -1, -1, -1, -1};
+	int *stdio[3] = {&io.stdinfd, &io.stdoutfd, &io.stderrfd};
+	int fds[3], nfds = 0, pid = -1, pidfd = -1, i, j;
+	char **argv = NULL, **envp = NULL;
+	const char *path = NULL, *cwd = NULL, *workdir = NULL;
+	ssize_t n;
+
+	n = recvmsg(fd, &mh, MSG_CMSG_CLOEXEC);
+	if (n < 0)
+		return errno == EINTR || errno == EAGAIN;
+	if (n == 0)
+		return 0;
+
+	for (cmsg = CMSG_FIRSTHDR(&mh); cmsg != NULL; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		memcpy(fds, CMSG_DATA(cmsg), nfds * sizeof(int));
+	}
+
+	if (n < sizeof(*req)) {
+		fprintf(stderr, "zygote got an invalid request\n");
+		goto out;
+	}
+
+	for (i = 0, j = 0; i < 3; i++) {
+		if ((req->fds & (1 << i)) && j < nfds)
+			*stdio[i] = fds[j++];
+	}
+
+	if (req->argc == 0 || req->ngroups > NGROUPS_MAX ||
+	    n < sizeof(*req) + req->ngroups * sizeof(gid_t))
+		goto invalid;
+
+	argv = calloc(req->argc + 1, sizeof(*argv));
+	envp = calloc(req->envc + 1, sizeof(*envp));
+	if (argv == NULL || envp == NULL)
+		goto invalid;
+
+	p = buf + sizeof(*req) + req->ngroups * sizeof(gid_t);
+	end = buf + n;
+	for (i = 0; i < req->argc; i++) {
+		if ((argv[i] = hyper_zygote_string(&p, end)) == NULL)
+			goto invalid;
+	}
+	for (i = 0; i < req->envc; i++) {
+		if ((envp[i] = hyper_zygote_string(&p, end)) == NULL)
+			goto invalid;
+	}
+	if ((path = hyper_zygote_string(&p, end)) == NULL ||
+	    (cwd = hyper_zygote_string(&p, end)) == NULL ||
+	    (workdir = hyper_zygote_string(&p, end)) == NULL)
+		goto invalid;
+
+	pid = fork();
+	if (pid == 0) {
+		struct hyper_exec exec = {
+			.argv		= argv,
+			.tty		= req->tty,
+			.ptyno		= req->ptyno,
+			.errseq		= req->errseq,
+			.workdir	= strlen(workdir) ? (char *)workdir : NULL,
+		};
+		struct hyper_ids ids = {
+			.uid		= req->uid,
+			.gid		= req->gid,
+			.groups		= (gid_t *)(buf + sizeof(*req)),
+			.ngroups	= req->ngroups,
+		};
+		struct hyper_spawn s = {
+			.exec	= &exec,
+			.io	= &io,
+			.envp	= envp,
+			.envc	= req->envc,
+			.path	= path,
+			.cwd	= strlen(cwd) ? cwd : NULL,
+		};
+
+		if (req->ids)
+			exec.ids = &ids;
+		close(fd);
+		hyper_spawn_prepare_script(&s);
+		hyper_spawn_child(&s);
+	}
+
+	// not reaped before the message is sent, the pidfd is of the child
+	if (pid < 0)
+		pid = -errno;
+	else
+		pidfd = hyper_pidfd_open(pid);
+	hyper_zygote_send(fd, ZYGOTE_SPAWNED, pid < 0 ? pid : 0, req->seq,
+			  pid < 0 ? getpid() : pid, pidfd);
+	if (pidfd >= 0)
+		close(pidfd);
+	goto out;
+invalid:
+	fprintf(stderr, "zygote got an invalid request\n");
+	hyper_zygote_send(fd, ZYGOTE_SPAWNED, -EINVAL, req->seq, getpid(), -1);
+out:
+	for (i = 0; i < nfds; i++)
+		close(fds[i]);
+	free(argv);
+	free(envp);
+	return 1;
+}
+
+static void hyper_zygote_reap(int fd)
+{
+	siginfo_t info;
+	int code;
+
+	for (;;) {
+		memset(&info, 0, sizeof(info));
+		if (waitid(P_ALL, 0, &info, WEXITED | WNOHANG | WNOWAIT) < 0 ||
+		    info.si_pid == 0)
+			return;
+
+		// report while the zombie still holds its pid
+		code = info.si_code == CLD_EXITED ? info.si_status : 0;
+		hyper_zygote_send(fd, ZYGOTE_EXITED, code, 0, info.si_pid, -1);
+		waitpid(info.si_pid, NULL, 0);
+	}
+}
+
+static void hyper_zygote_loop(int fd)
+{
+	struct signalfd_siginfo si;
+	struct pollfd pfd[2];
+	siginfo_t info;
+	sigset_t mask;
+
+	// SIGCHLD is still blocked as in hyperstart
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	pfd[1].fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (pfd[1].fd < 0) {
+		perror("create zygote signalfd failed");
+		_exit(125);
+	}
+	pfd[0].fd = fd;
+	pfd[0].events = POLLIN;
+	pfd[1].events = POLLIN;
+
+	for (;;) {
+		if (poll(pfd, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("zygote poll failed");
+			_exit(125);
+		}
+
+		if (pfd[1].revents) {
+			while (read(pfd[1].fd, &si, sizeof(si)) > 0)
+				;
+			hyper_zygote_reap(fd);
+		}
+
+		// stopped, linger until every exit is reported
+		if (pfd[0].revents && !hyper_zygote_recv(fd))
+			pfd[0].fd = -1;
+
+		memset(&info, 0, sizeof(info));
+		if (pfd[0].fd < 0 &&
+		    waitid(P_ALL, 0, &info, WEXITED | WNOHANG | WNOWAIT) < 0 &&
+		    errno == ECHILD)
+			_exit(0);
+	}
+}
+
+/* keep the console, the socket and the namespaces to enter only */
+static void hyper_zygote_close_fds(struct hyper_container *c, struct hyper_pod *pod, int fd)
+{
+	struct dirent *de;
+	DIR *dp;
+	int i;
+
+	dp = opendir("/proc/self/fd");
+	if (dp == NULL)
+		return;
+
+	while ((de = readdir(dp)) != NULL) {
+		if (!isdigit(de->d_name[0]))
+			continue;
+		i = atoi(de->d_name);
+		if (i <= STDERR_FILENO || i == fd || i == dirfd(dp) || i == c->ns ||
+		    i == pod->pidns || i == pod->utsns || i == pod->ipcns)
+			continue;
+		close(i);
+	}
+
+	closedir(dp);
+}
+
+static void hyper_zygote_init(struct hyper_container *c, struct hyper_pod *pod, int fd)
+{
+	hyper_zygote_close_fds(c, pod, fd);
+
+	// the process in between sends the zygote pid and exits
+	if (hyper_enter_sandbox(pod, fd) < 0)
+		_exit(125);
+
+	if (setns(c->ns, CLONE_NEWNS) < 0 || chdir("/") < 0) {
+		perror("zygote enter container failed");
+		_exit(125);
+	}
+
+	close(c->ns);
+	close(pod->pidns);
+	close(pod->utsns);
+	close(pod->ipcns);
+	hyper_zygote_loop(fd);
+}
+
+static int hyper_zygote_read(struct hyper_event *he, int efd, int events);
+static void hyper_zygote_hup(struct hyper_event *he, int efd);
+
+static struct hyper_event_ops zygote_ops = {
+	.read		= hyper_zygote_read,
+	.hup		= hyper_zygote_hup,
+};
+
+static struct hyper_zygote *hyper_zygote_start(struct hyper_container *c, struct hyper_pod *pod)
+{
+	struct hyper_zygote *z;
+	int sv[2], pid, ret, one = 1;
+	uint32_t zpid;
+
+	z = calloc(1, sizeof(*z));
+	if (z == NULL)
+		return NULL;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+		perror("create zygote socket failed");
+		free(z);
+		return NULL;
+	}
+
+	if (setsockopt(sv[0], SOL_SOCKET, SO_PASSCRED, &one, sizeof(one)) < 0) {
+		perror("pass zygote credentials failed");
+		goto fail;
+	}
+
+	fflush(NULL);
+	pid = fork();
+	if (pid < 0) {
+		perror("fork zygote failed");
+		goto fail;
+	} else if (pid == 0) {
+		close(sv[0]);
+		hyper_zygote_init(c, pod, sv[1]);
+		_exit(125);
+	}
+
+	close(sv[1]);
+	sv[1] = -1;
+	ret = hyper_get_type(sv[0], &zpid);
+	// reap the process in between here, not as an unknown exit
+	waitpid(pid, NULL, 0);
+	if (ret < 0 || (int)zpid <= 0) {
+		fprintf(stderr, "zygote of container %s failed to start\n", c->id);
+		goto fail;
+	}
+
+	z->ev.fd = sv[0];
+	if (hyper_init_event(&z->ev, &zygote_ops, NULL) < 0 ||
+	    hyper_add_event(hyper_epoll.efd, &z->ev, EPOLLIN) < 0) {
+		fprintf(stderr, "add zygote event failed\n");
+		hyper_reset_event(&z->ev);
+		kill(zpid, SIGKILL);
+		free(z);
+		return NULL;
+	}
+
+	z->c = c;
+	z->pod = pod;
+	z->pid = zpid;
+	fprintf(stdout, "zygote of container %s pid %d\n", c->id, z->pid);
+	return z;
+fail:
+	close(sv[0]);
+	close(sv[1]);
+	free(z);
+	return NULL;
+}
+
+/* ask the zygote of the container for the process, 0 if it was sent */
+static int hyper_zygote_spawn(struct hyper_exec *exec, struct stdio_config *io)
+{
+	struct hyper_container *c;
+	struct hyper_spawn s = {
+		.exec	= exec,
+		.io	= io,
+	};
+	struct hyper_zygote_req req = {
+		.seq	= exec->seq,
+		.tty	= exec->tty,
+		.ptyno	= exec->ptyno,
+		.errseq	= exec->errseq > 0,
+		.argc	= exec->argc,
+	};
+	int stdio[3] = {io->stdinfd, io->stdoutfd, io->stderrfd};
+	char cbuf[CMSG_SPACE(sizeof(stdio))];
+	struct iovec iov;
+	struct msghdr mh = {
+		.msg_iov	= &iov,
+		.msg_iovlen	= 1,
+	};
+	struct cmsghdr *cmsg;
+	int fds[3], nfds = 0, i, ret = -1;
+	const char *str[3];
+	size_t len;
+	char *buf, *p;
+
+	if (exec->init || exec->argc == 0 || (hyper_exec_has_ids(exec) && exec->ids == NULL))
+		return -1;
+
+	c = hyper_find_container(exec->pod, exec->container_id);
+	if (c == NULL || !c->use_zygote || exec->pod->pidns < 0)
+		return -1;
+
+	if (c->zygote == NULL)
+		c->zygote = hyper_zygote_start(c, exec->pod);
+	if (c->zygote == NULL || c->zygote->stopping)
+		return -1;
+
+	s.c = c;
+	if (hyper_spawn_prepare(&s) < 0) {
+		fprintf(stderr, "prepare exec envs failed\n");
+		goto out;
+	}
+
+	str[0] = s.path;
+	str[1] = s.cwd ? s.cwd : "";
+	str[2] = exec->workdir ? exec->workdir : "";
+	req.envc = s.envc;
+
+	if (exec->ids != NULL) {
+		req.ids = 1;
+		req.uid = exec->ids->uid;
+		req.gid = exec->ids->gid;
+		req.ngroups = exec->ids->ngroups;
+	}
+
+	len = sizeof(req) + req.ngroups * sizeof(gid_t);
+	for (i = 0; i < exec->argc; i++)
+		len += strlen(exec->argv[i]) + 1;
+	for (i = 0; i < s.envc; i++)
+		len += strlen(s.envp[i]) + 1;
+	for (i = 0; i < 3; i++)
+		len += strlen(str[i]) + 1;
+	if (len > ZYGOTE_MSG_MAX)
+		goto out;
+
+	for (i = 0; i < 3; i++) {
+		if (stdio[i] < 0)
+			continue;
+		fds[nfds++] = stdio[i];
+		req.fds |= 1 << i;
+	}
+
+	buf = malloc(len);
+	if (buf == NULL)
+		goto out;
+
+	memcpy(buf, &req, sizeof(req));
+	p = buf + sizeof(req);
+	if (req.ngroups > 0)
+		memcpy(p, exec->ids->groups, req.ngroups * sizeof(gid_t));
+	p += req.ngroups * sizeof(gid_t);
+	for (i = 0; i < exec->argc; i++)
+		p = stpcpy(p, exec->argv[i]) + 1;
+	for (i = 0; i < s.envc; i++)
+		p = stpcpy(p, s.envp[i]) + 1;
+	for (i = 0; i < 3; i++)
+		p = stpcpy(p, str[i]) + 1;
+
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	if (nfds > 0) {
+		mh.msg_control = cbuf;
+		mh.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+		cmsg = CMSG_FIRSTHDR(&mh);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+		memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+	}
+
+	if (sendmsg(c->zygote->ev.fd, &mh, MSG_NOSIGNAL | MSG_DONTWAIT) < 0) {
+		perror("send zygote request failed");
+	} else {
+		exec->zygote = c->zygote;
+		ret = 0;
+	}
+	free(buf);
+out:
+	hyper_spawn_free_envp(&s);
+	return ret;
+}
+
+static int hyper_zygote_read(struct hyper_event *he, int efd, int events)
+{
+	struct hyper_zygote *z = container_of(he, struct hyper_zygote, ev);
+	struct hyper_exec_launch *launch, *tmp;
+	struct hyper_exec *exec;
+	struct hyper_zygote_msg msg;
+	struct ucred cred;
+	char cbuf[CMSG_SPACE(sizeof(cred)) + CMSG_SPACE(sizeof(int))]
+		__attribute__((aligned(8)));
+	struct iovec iov = {
+		.iov_base	= &msg,
+		.iov_len	= sizeof(msg),
+	};
+	struct msghdr mh;
+	struct cmsghdr *cmsg;
+	int pidfd, credp;
+	ssize_t n;
+
+	for (;;) {
+		memset(&mh, 0, sizeof(mh));
+		mh.msg_iov = &iov;
+		mh.msg_iovlen = 1;
+		mh.msg_control = cbuf;
+		mh.msg_controllen = sizeof(cbuf);
+
+		n = recvmsg(he->fd, &mh, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno == EAGAIN)
+			return 0;
+		if (n <= 0) {
+			// the zygote is gone
+			hyper_zygote_close(z);
+			return 0;
+		}
+
+		pidfd = -1;
+		credp = 0;
+		for (cmsg = CMSG_FIRSTHDR(&mh); cmsg != NULL; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+			if (cmsg->cmsg_level != SOL_SOCKET)
+				continue;
+			if (cmsg->cmsg_type == SCM_CREDENTIALS) {
+				memcpy(&cred, CMSG_DATA(cmsg), sizeof(cred));
+				credp = 1;
+			} else if (cmsg->cmsg_type == SCM_RIGHTS &&
+				   cmsg->cmsg_len == CMSG_LEN(sizeof(int))) {
+				memcpy(&pidfd, CMSG_DATA(cmsg), sizeof(int));
+			}
+		}
+
+		if (n != sizeof(msg) || !credp) {
+			fprintf(stderr, "invalid message from zygote %d\n", z->pid);
+			if (pidfd >= 0)
+				close(pidfd);
+			continue;
+		}
+
+		if (msg.type == ZYGOTE_EXITED) {
+			fprintf(stdout, "zygote child %d exit, code %d\n", cred.pid, msg.code);
+			exec = hyper_find_exec_by_pid(z->pod, cred.pid);
+			if (exec != NULL && exec->zygote == z && !exec->exit)
+				hyper_exec_exited(exec, msg.code);
+			continue;
+		}
+
+		list_for_each_entry_safe(launch, tmp, &hyper_launching, list) {
+			if (launch->exec->zygote != z || launch->exec->seq != msg.seq)
+				continue;
+			if (msg.code < 0)
+				fprintf(stderr, "zygote fork failed: %s\n", strerror(-msg.code));
+			// only to signal it, the exit still comes from the zygote
+			launch->exec->sigfd = pidfd;
+			pidfd = -1;
+			hyper_exec_launch_finish(launch, msg.code < 0 ? -1 : cred.pid);
+			break;
+		}
+		if (pidfd >= 0)
+			close(pidfd);
+	}
+}
+
+static void hyper_zygote_hup(struct hyper_event *he, int efd)
+{
+	hyper_zygote_close(container_of(he, struct hyper_zygote, ev));
+}
+
+/* no more requests, the zygote exits once its children are gone */
+static void hyper_zygote_stop(struct hyper_zygote *z)
+{
+	fprintf(stdout, "stop zygote %d\n", z->pid);
+	z->stopping = 1;
+	shutdown(z->ev.fd, SHUT_WR);
+}
+
+void hyper_zygote_close(struct hyper_zygote *z)
+{
+	struct hyper_exec_launch *launch, *tmp;
+	struct hyper_exec *exec, *next;
+
+	fprintf(stdout, "zygote %d of container %s closed\n", z->pid, z->c->id);
+	list_for_each_entry_safe(launch, tmp, &hyper_launching, list) {
+		if (launch->exec->zygote == z)
+			hyper_exec_launch_finish(launch, -1);
+	}
+
+	// no exit report comes for what is left
+	list_for_each_entry_safe(exec, next, &z->pod->exec_head, list) {
+		if (exec->zygote != z)
+			continue;
+		exec->zygote = NULL;
+		if (!exec->exit)
+			hyper_exec_exited(exec, 255);
+	}
+
+	hyper_reset_event(&z->ev);
+	z->c->zygote = NULL;
+	free(z);
 }
 
-int hyper_run_process(struct hyper_exec *exec)
+/*
+ * start launching the process, done() is called once the pid is known,
+ * before returning on the spawn path. Not called if it returns -1.
+ */
+int hyper_run_process(struct hyper_exec *exec, hyper_exec_done done, void *data)
 {
 	int pipe[2] = {-1, -1};
 	int pid, ret = -1;
-	uint32_t type;
 	struct stdio_config io = {-1, -1,-1, -1,-1, -1};
+	struct hyper_exec_launch *launch = NULL;
+	struct hyper_ids ids;
 
-	if (exec->argv == NULL || exec->seq == 0 || exec->container_id == NULL || strlen(exec->container_id) == 0) {
+	if (exec->argv == NULL || exec->argc == 0 || exec->seq == 0 ||
+	    exec->container_id == NULL || strlen(exec->container_id) == 0) {
 		fprintf(stderr, "cmd is %p, seq %" PRIu64 ", container %s\n",
 			exec->argv, exec->seq, exec->container_id);
 		goto out;
 	}
 
+	if (exec->datachannel && !exec->tty && exec->datafd < 0)
+		return hyper_exec_connect(exec, done, data);
+
+	launch = hyper_pool_zalloc(&hyper_launch_pool);
+	if (launch == NULL) {
+		fprintf(stderr, "allocate exec launch failed\n");
+		goto out;
+	}
+	launch->ev.fd = -1;
+
 	if (hyper_setup_stdio(exec, &io) < 0) {
 		fprintf(stderr, "setup exec tty failed\n");
 		goto out;
 	}
 
+	// only for the launch, the children get a copy
+	if (hyper_exec_resolve_ids(exec, &ids) == 0)
+		exec->ids = &ids;
+
+	if (hyper_zygote_spawn(exec, &io) == 0) {
+		fprintf(stdout, "process of seq %" PRIu64 " requested from zygote\n", exec->seq);
+		goto launching;
+	}
+
+	pid = hyper_spawn_process(exec, &io);
+	if (pid < 0)
+		goto close_tty;
+	if (pid > 0) {
+		fprintf(stdout, "spawn process pid %d\n", pid);
+		ret = hyper_exec_launched(exec, &io, pid, NULL);
+		if (ret < 0)
+			hyper_exec_launch_close(exec, &io);
+		done(exec, ret, data);
+		ret = 0;
+		goto out;
+	}
+
 	if (pipe2(pipe, O_CLOEXEC) < 0) {
 		perror("create pipe between pod init execcmd failed");
 		goto close_tty;
@@ -654,39 +2608,48 @@ int hyper_run_process(struct hyper_exec *exec)
 		hyper_do_exec_cmd(exec, pipe[1], &io);
 	}
 	fprintf(stdout, "prerequisite process pid %d\n", pid);
+	// the helper of a container exec only forks the process into the pod
+	if (strcmp(exec->container_id, HYPERSTART_EXEC_CONTAINER))
+		launch->helper = pid;
 
-	if (hyper_get_type(pipe[0], &type) < 0 || (int)type < 0) {
-		fprintf(stderr, "run process failed\n");
-		goto close_tty;
-	}
+	// only the helper may write, its exit closes the pipe
+	close(pipe[1]);
+	pipe[1] = -1;
 
-	if (hyper_setup_stdio_events(exec, &io) < 0) {
-		fprintf(stderr, "add pts master event failed\n");
+	launch->ev.fd = pipe[0];
+	if (hyper_init_event(&launch->ev, &launch_ops, NULL) < 0 ||
+	    hyper_add_event(hyper_epoll.efd, &launch->ev, EPOLLIN) < 0) {
+		fprintf(stderr, "add exec launch event failed\n");
 		goto close_tty;
 	}
-
-	exec->pid = type;
-	list_add_tail(&exec->list, &exec->pod->exec_head);
-	exec->ref++;
-	fprintf(stdout, "%s process pid %d\n", __func__, exec->pid);
+	pipe[0] = -1;
+launching:
+	launch->gen = ++hyper_launch_gen;
+	launch->exec = exec;
+	launch->io = io;
+	launch->done = done;
+	launch->data = data;
+	list_add_tail(&launch->list, &hyper_launching);
+	launch = NULL;
 	ret = 0;
 out:
+	if (exec->ids == &ids) {
+		hyper_ids_free(&ids);
+		exec->ids = NULL;
+	}
+	if (exec->datafd >= 0) {
+		close(exec->datafd);
+		exec->datafd = -1;
+	}
 	close(io.stdinfd);
 	close(io.stdoutfd);
 	close(io.stderrfd);
 	close(pipe[0]);
 	close(pipe[1]);
+	hyper_pool_free(&hyper_launch_pool, launch);
 	return ret;
 close_tty:
-	hyper_reset_event(&exec->stdinev);
-	hyper_reset_event(&exec->stdoutev);
-	hyper_reset_event(&exec->stderrev);
-	list_del_init(&exec->list);
-
-	close(exec->ptyfd);
-	close(io.stdinevfd);
-	close(io.stdoutevfd);
-	close(io.stderrevfd);
+	hyper_exec_launch_close(exec, &io);
 	goto out;
 }
 
@@ -704,7 +2667,7 @@ static int hyper_release_exec(struct hyper_exec *exec)
 	hyper_reset_event(&exec->stdoutev);
 	hyper_reset_event(&exec->stderrev);
 
-	list_del_init(&exec->list);
+	hyper_exec_unlink(exec);
 
 	hyper_send_exec_eof(exec);
 
@@ -723,7 +2686,7 @@ static int hyper_release_exec(struct hyper_exec *exec)
 		return 0;
 	}
 
-	hyper_free_exec(exec);
+	hyper_destroy_exec(exec);
 	return 0;
 }
 
@@ -749,8 +2712,8 @@ struct hyper_exec *hyper_find_exec_by_name(struct hyper_pod *pod, const char *pr
 {
 	struct hyper_exec *exec;
 
-	list_for_each_entry(exec, &pod->exec_head, list) {
-		if (strcmp(exec->id, process) == 0) {
+	hlist_for_each_entry(exec, &pod->exec_id_hash[hyper_hash_str(process, HYPER_EXEC_HASH_BITS)], id_node) {
+		if (exec->id && strcmp(exec->id, process) == 0) {
 			return exec;
 		}
 	}
@@ -758,12 +2721,13 @@ struct hyper_exec *hyper_find_exec_by_name(struct hyper_pod *pod, const char *pr
 	return NULL;
 }
 
-struct hyper_exec *hyper_find_exec_by_pid(struct list_head *head, int pid)
+struct hyper_exec *hyper_find_exec_by_pid(struct hyper_pod *pod, int pid)
 {
 	struct hyper_exec *exec;
 
-	list_for_each_entry(exec, head, list) {
-		if (exec->pid != pid)
+	// an exited exec may still flush its output, its pid can be reused
+	hlist_for_each_entry(exec, &pod->exec_pid_hash[hyper_hash_64(pid, HYPER_EXEC_HASH_BITS)], pid_node) {
+		if (exec->pid != pid || exec->exit)
 			continue;
 
 		return exec;
@@ -776,7 +2740,7 @@ struct hyper_exec *hyper_find_exec_by_seq(struct hyper_pod *pod, uint64_t seq)
 {
 	struct hyper_exec *exec;
 
-	list_for_each_entry(exec, &pod->exec_head, list) {
+	hlist_for_each_entry(exec, &pod->exec_seq_hash[hyper_hash_64(seq, HYPER_EXEC_HASH_BITS)], seq_node) {
 		if (exec->seq != seq)
 			continue;
 
@@ -814,7 +2778,8 @@ static int hyper_kill_container_processes(struct hyper_container *c) {
 			if (!isdigit(de->d_name[0]))
 				continue;
 			pid = atoi(de->d_name);
-			if (pid == 1 || pid == c->exec.pid)
+			if (pid == 1 || pid == c->exec.pid ||
+			    (c->zygote != NULL && pid == c->zygote->pid))
 				continue;
 
 			sprintf(mntns, "/proc/%d/ns/mnt", pid);
@@ -837,28 +2802,139 @@ static int hyper_kill_container_processes(struct hyper_container *c) {
 	return 0;
 }
 
-int hyper_handle_exec_exit(struct hyper_pod *pod, int pid, uint8_t code)
+static void hyper_exec_exited(struct hyper_exec *exec, uint8_t code)
 {
-	struct hyper_exec *exec;
-
-	exec = hyper_find_exec_by_pid(&pod->exec_head, pid);
-	if (exec == NULL) {
-		return 0;
-	}
-
 	fprintf(stdout, "%s exec exit pid %d, seq %" PRIu64 ", container %s\n",
 		__func__, exec->pid, exec->seq, exec->container_id);
 
 	exec->code = code;
 	exec->exit = 1;
+	hyper_timer_del(&exec->timer);
 
 	close(exec->ptyfd);
 	exec->ptyfd = -1;
 
-	if (exec->init)
-		hyper_kill_container_processes(container_of(exec, struct hyper_container, exec));
+	if (exec->sigfd >= 0) {
+		close(exec->sigfd);
+		exec->sigfd = -1;
+	}
 
-	hyper_release_exec(exec);
+	if (exec->init) {
+		struct hyper_container *c = container_of(exec, struct hyper_container, exec);
+
+		if (c->zygote != NULL)
+			hyper_zygote_stop(c->zygote);
+		hyper_kill_container_processes(c);
+	}
+
+	// with a pidfd, its event holds the process reference
+	if (exec->pidev.fd < 0)
+		hyper_release_exec(exec);
+}
+
+int hyper_handle_exec_exit(struct hyper_pod *pod, int pid, uint8_t code)
+{
+	struct hyper_exec *exec;
+
+	exec = hyper_find_exec_by_pid(pod, pid);
+	if (exec == NULL) {
+		// maybe a process whose launch hasn't reported the pid yet
+		if (!list_empty(&hyper_launching))
+			hyper_exit_history_add(pid, code);
+		return 0;
+	}
+
+	hyper_exec_exited(exec, code);
+	return 0;
+}
+
+/*
+ * The pidfd turns readable once the process exits, then it is reaped
+ * here directly. If SIGCHLD got to it first the exit is already handled
+ * and only the pidfd is left to release. The pidfd is closed from its
+ * own event only, so no pending event refers to a freed exec.
+ */
+static int hyper_exec_pid_read(struct hyper_event *he, int efd, int events)
+{
+	struct hyper_exec *exec = container_of(he, struct hyper_exec, pidev);
+	siginfo_t info;
+
+	if (!exec->exit) {
+		memset(&info, 0, sizeof(info));
+		if (waitid(HYPER_P_PIDFD, he->fd, &info, WEXITED | WNOHANG) < 0) {
+			// not reparented to us yet, SIGCHLD will tell
+			if (errno == ECHILD)
+				return 0;
+			perror("wait for pidfd failed, use SIGCHLD");
+			hyper_reset_event(he);
+			return 0;
+		}
+		if (info.si_pid == 0)
+			return 0;
+
+		fprintf(stdout, "pid %d exit, code %d status %d\n",
+			info.si_pid, info.si_code, info.si_status);
+		hyper_exec_exited(exec, info.si_code == CLD_EXITED ? info.si_status : 0);
+	}
 
+	hyper_reset_event(he);
+	hyper_release_exec(exec);
 	return 0;
 }
+
+static struct hyper_event_ops pid_ops = {
+	.read		= hyper_exec_pid_read,
+};
+
+static void hyper_exec_track_pid(struct hyper_exec *exec)
+{
+	exec->pidev.fd = hyper_pidfd_open(exec->pid);
+	if (exec->pidev.fd < 0) {
+		perror("open pidfd failed, track the pid only");
+		return;
+	}
+
+	if (hyper_init_event(&exec->pidev, &pid_ops, NULL) < 0 ||
+	    hyper_add_event(hyper_epoll.efd, &exec->pidev, EPOLLIN) < 0) {
+		fprintf(stderr, "add pidfd event failed\n");
+		hyper_reset_event(&exec->pidev);
+	}
+}
+
+/* time for an exec to exit after SIGTERM before it gets SIGKILL */
+#define HYPER_EXEC_KILL_GRACE	2000
+
+static void hyper_exec_kill(struct hyper_timer *t)
+{
+	struct hyper_exec *exec = container_of(t, struct hyper_exec, timer);
+
+	fprintf(stdout, "exec %s ignores SIGTERM, kill it\n", exec->id);
+	hyper_exec_signal(exec, SIGKILL);
+}
+
+/* the exec ran out of its wall-clock time */
+static void hyper_exec_timeout(struct hyper_timer *t)
+{
+	struct hyper_exec *exec = container_of(t, struct hyper_exec, timer);
+
+	fprintf(stdout, "exec %s timed out after %" PRIu32 "ms\n", exec->id, exec->timeout);
+	if (hyper_exec_signal(exec, SIGTERM) == 0)
+		hyper_timer_add(t, HYPER_EXEC_KILL_GRACE, hyper_exec_kill);
+}
+
+/* signal the process of exec, never a later process reusing its pid */
+int hyper_exec_signal(struct hyper_exec *exec, int sig)
+{
+	// not started yet, kill(0, ...) would hit hyperstart itself
+	if (exec->exit || exec->pid == 0) {
+		errno = ESRCH;
+		return -1;
+	}
+
+	if (exec->pidev.fd >= 0)
+		return hyper_pidfd_send_signal(exec->pidev.fd, sig);
+	if (exec->sigfd >= 0)
+		return hyper_pidfd_send_signal(exec->sigfd, sig);
+
+	return kill(exec->pid, sig);
+}
@@ -3,23 +3,56 @@
 
 #include "list.h"
 #include "event.h"
+#include "timer.h"
 
 struct env {
 	char	*env;
 	char	*value;
 };
 
+struct hyper_tty;
+struct hyper_zygote;
+struct hyper_ids;
+
+/* stdout/stderr of an exec, scheduled onto the tty channel */
+struct hyper_stream {
+	struct list_head	list;
+	struct hyper_event	*ev;
+	struct hyper_exec	*exec;
+	struct hyper_tty	*tty;
+	uint64_t		seq;
+	int			deficit;
+	/* held for coalescing until it fires, see exec.c */
+	struct hyper_timer	timer;
+	uint8_t			active;
+	uint8_t			hup;
+};
+
 struct hyper_exec {
 	struct list_head	list;
+	/* in the pod indexes while on exec_head */
+	struct hlist_node	seq_node;
+	struct hlist_node	pid_node;
+	struct hlist_node	id_node;
 	struct hyper_pod	*pod;
 
 	struct hyper_event	stdinev;
 	struct hyper_event	stdoutev;
 	struct hyper_event	stderrev;
+	/* pidfd of the process, -1 if the kernel has no pidfd */
+	struct hyper_event	pidev;
+	/* the zygote that spawned the process and reports its exit */
+	struct hyper_zygote	*zygote;
+	/* pidfd from the zygote to signal its child only, -1 if none */
+	int			sigfd;
+	struct hyper_stream	outstream;
+	struct hyper_stream	errstream;
 	int			pid;
 	int			ptyno;
 	int			init;
 	int			ptyfd;
+	/* stdin bytes written to the process, not yet returned to the host */
+	uint32_t		stdin_credit;
 	uint8_t			close_stdin_request;
 	uint8_t			code;
 	uint8_t			exit;
@@ -37,19 +70,36 @@ struct hyper_exec {
 	char			**argv;
 	int			argc;
 	int			tty; // use tty or not
+	int			weight; // share of the tty channel
+	int			coalesce; // STREAM_COALESCE_*
+	uint32_t		timeout; // ms, 0 means no limit
+	struct hyper_timer	timer;
 	uint64_t		seq;
 	uint64_t		errseq;
 	char			*workdir;
+	char			*datachannel;
+	/* the data channel, connected before the launch, -1 until then */
+	int			datafd;
+	/* user and groups looked up before the launch, NULL if the process does */
+	struct hyper_ids	*ids;
 };
 
 struct hyper_pod;
 
-int hyper_exec_cmd(struct hyper_pod *pod, char *json, int length);
-int hyper_run_process(struct hyper_exec *e);
+typedef void (*hyper_exec_done)(struct hyper_exec *exec, int ret, void *data);
+
+int hyper_exec_cmd(struct hyper_pod *pod, char *data, int length);
+int hyper_run_process(struct hyper_exec *e, hyper_exec_done done, void *data);
 struct hyper_exec *hyper_find_process(struct hyper_pod *pod, const char *container, const char *process);
 struct hyper_exec *hyper_find_exec_by_name(struct hyper_pod *pod, const char *process);
-struct hyper_exec *hyper_find_exec_by_pid(struct list_head *head, int pid);
+struct hyper_exec *hyper_find_exec_by_pid(struct hyper_pod *pod, int pid);
 struct hyper_exec *hyper_find_exec_by_seq(struct hyper_pod *pod, uint64_t seq);
 int hyper_handle_exec_exit(struct hyper_pod *pod, int pid, uint8_t code);
+int hyper_exec_signal(struct hyper_exec *exec, int sig);
+void hyper_zygote_close(struct hyper_zygote *z);
+int hyper_splice_continue(struct hyper_tty *tty);
+int hyper_exec_stdin_consumed(struct hyper_exec *exec, uint32_t size);
+void hyper_splice_finish(struct hyper_tty *tty);
+void hyper_stream_schedule(struct hyper_tty *tty);
 
 #endif
@@ -0,0 +1,25 @@
+#ifndef _HASH_H_
+#define _HASH_H_
+
+#include <stdint.h>
+
+/* multiplicative hash of val to bits bits, the kernel's hash_64() */
+static inline uint32_t hyper_hash_64(uint64_t val, int bits)
+{
+	return (val * 0x61C8864680B583EBULL) >> (64 - bits);
+}
+
+/* FNV-1a of the string, folded to bits bits */
+static inline uint32_t hyper_hash_str(const char *s, int bits)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	while (*s) {
+		h ^= (uint8_t)*s++;
+		h *= 0x100000001b3ULL;
+	}
+
+	return hyper_hash_64(h, bits);
+}
+
+#endif
@@ -10,11 +10,16 @@
 #include "api.h"
 #include "net.h"
 #include "list.h"
+#include "hash.h"
 #include "exec.h"
 #include "event.h"
+#include "timer.h"
 #include "container.h"
 #include "portmapping.h"
 
+#define HYPER_EXEC_HASH_BITS		10
+#define HYPER_CONTAINER_HASH_BITS	6
+
 /* Path to rootfs shared directory */
 #define SHARED_DIR "/tmp/hyper/shared"
 
@@ -25,15 +30,30 @@ struct hyper_pod {
 	char			**dns;
 	struct list_head	containers;
 	struct list_head	exec_head;
+	/* indexes of exec_head by seq, pid and id, of containers by id */
+	struct hlist_head	exec_seq_hash[1 << HYPER_EXEC_HASH_BITS];
+	struct hlist_head	exec_pid_hash[1 << HYPER_EXEC_HASH_BITS];
+	struct hlist_head	exec_id_hash[1 << HYPER_EXEC_HASH_BITS];
+	struct hlist_head	container_hash[1 << HYPER_CONTAINER_HASH_BITS];
 	char			*hostname;
 	char			*share_tag;
 	int			init_pid;
+	/* namespaces of pod init, opened once it is started */
+	int			pidns;
+	int			utsns;
+	int			ipcns;
 	uint32_t		i_num;
 	uint32_t		r_num;
 	uint32_t		d_num;
 	/* how many containers are running */
 	uint32_t		remains;
 	int			req_destroy;
+	/* DESTROYPOD requests, a retry is answered with the first one */
+	struct hyper_ctl_request	**destroy_reqs;
+	int			destroy_num;
+	/* SIGKILL what is left once the grace period (ms) of SIGTERM is over */
+	struct hyper_timer	stop_timer;
+	uint32_t		stop_grace;
 	int			efd;
 };
 
@@ -55,10 +75,59 @@ struct file_command {
 	char		*file;
 };
 
+/* decoded WINSIZE, SIGNALPROCESS and KILLCONTAINER command */
+struct hyper_process_cmd {
+	const char	*container;
+	const char	*process;
+	int		signal;
+	int		row;
+	int		column;
+};
+
+/* protocol features supported by this hyperstart, see api.h */
+#define HYPER_FEATURES		(FEATURE_BINARY_CMD | FEATURE_BATCH | FEATURE_REQUEST_ID | \
+				 FEATURE_CTL_CREDIT | FEATURE_STREAM_CREDIT | \
+				 FEATURE_STREAM_COMPRESS | FEATURE_MULTI_TTY)
+
+struct hyper_ctl_batch;
+
+/* a control command whose reply is sent later by hyper_ctl_complete() */
+struct hyper_ctl_request {
+	uint32_t		id;
+	uint32_t		type;
+	int			hdrsize;
+	/* the ctl connection it came in on, see hyper_channel_accept() */
+	uint32_t		session;
+	int			deferred;
+	struct hyper_ctl_batch	*batch;
+	int			index;
+};
+
+#define HYPER_TTY_MAX		8
+
+/* a stream channel port, sh.hyper.channel.1 is the first one */
+struct hyper_tty {
+	struct hyper_event	ev;
+	/* stream frame being spliced from an exec pipe to the port */
+	struct hyper_event	*splice_src;
+	uint32_t		splice_left;
+	/* output streams waiting for the port */
+	struct list_head	streams;
+};
+
 struct hyper_epoll {
 	int			efd;
+	uint32_t		features;
+	/* bytes read from ctl but not yet returned to the host */
+	uint32_t		ctl_credit;
+	int			splice_off;
 	struct hyper_event	ctl;
-	struct hyper_event	tty;
+	struct hyper_tty	tty[HYPER_TTY_MAX];
+	int			tty_num;
+	/* signalfd of SIGCHLD, children are reaped in the loop */
+	struct hyper_event	sigchld;
+	/* timerfd of the timer wheel, see timer.c */
+	struct hyper_event	timer;
 };
 
 static inline int hyper_symlink(char *oldpath, char *newpath)
@@ -85,7 +154,18 @@ int hyper_open_serial(char *tty);
 int hyper_enter_sandbox(struct hyper_pod *pod, int pidpipe);
 void hyper_pod_destroyed(int failed);
 int hyper_ctl_append_msg(struct hyper_event *he, uint32_t type, uint8_t *data, uint32_t len);
+struct hyper_ctl_request *hyper_ctl_defer(void);
+int hyper_ctl_complete(struct hyper_ctl_request *req, int ret, uint8_t *data, uint32_t datalen);
 
 extern struct hyper_epoll hyper_epoll;
+
+/* the stream port of a sequence, all ports are used once the host agrees */
+static inline struct hyper_tty *hyper_tty_of(uint64_t seq)
+{
+	if (!(hyper_epoll.features & FEATURE_MULTI_TTY))
+		return &hyper_epoll.tty[0];
+
+	return &hyper_epoll.tty[seq % hyper_epoll.tty_num];
+}
 extern sigset_t orig_mask;
 #endif
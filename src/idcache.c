@@ -0,0 +1,395 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <pwd.h>
+#include <sys/stat.h>
+
+#include "util.h"
+#include "idcache.h"
+
+/*
+ * The passwd and group files under a root, e.g. /proc/PID/root of the
+ * container init, parsed once and kept until a file changes. The files
+ * are opened without following symlinks, an absolute link would resolve
+ * in our own root; the caller looks them up in the process instead. The
+ * lookups are the ones of hyper_getpwnam(), hyper_getgrnam() and
+ * hyper_getgrouplist().
+ */
+struct hyper_pwent {
+	char	*name;
+	char	*dir;
+	uid_t	uid;
+	gid_t	gid;
+};
+
+struct hyper_grent {
+	char	*name;
+	char	**mem;
+	gid_t	gid;
+};
+
+/* what tells a file changed since it was parsed */
+struct hyper_idstat {
+	dev_t		dev;
+	ino_t		ino;
+	off_t		size;
+	struct timespec	mtime;
+	struct timespec	ctime;
+};
+
+struct hyper_idcache {
+	int			root;
+	struct hyper_idstat	pwstat;
+	struct hyper_idstat	grstat;
+	struct hyper_pwent	*pw;
+	int			npw;
+	struct hyper_grent	*gr;
+	int			ngr;
+};
+
+#define IDCACHE_GROW	64
+
+static void hyper_idstat_set(struct hyper_idstat *is, struct stat *st)
+{
+	is->dev = st->st_dev;
+	is->ino = st->st_ino;
+	is->size = st->st_size;
+	is->mtime = st->st_mtim;
+	is->ctime = st->st_ctim;
+}
+
+static int hyper_idstat_same(struct hyper_idstat *is, struct stat *st)
+{
+	return is->ino == st->st_ino && is->dev == st->st_dev && is->size == st->st_size &&
+	       is->mtime.tv_sec == st->st_mtim.tv_sec && is->mtime.tv_nsec == st->st_mtim.tv_nsec &&
+	       is->ctime.tv_sec == st->st_ctim.tv_sec && is->ctime.tv_nsec == st->st_ctim.tv_nsec;
+}
+
+static void hyper_idcache_free_passwd(struct hyper_idcache *ic)
+{
+	int i;
+
+	for (i = 0; i < ic->npw; i++) {
+		free(ic->pw[i].name);
+		free(ic->pw[i].dir);
+	}
+	free(ic->pw);
+	ic->pw = NULL;
+	ic->npw = 0;
+	memset(&ic->pwstat, 0, sizeof(ic->pwstat));
+}
+
+static void hyper_idcache_free_group(struct hyper_idcache *ic)
+{
+	int i, j;
+
+	for (i = 0; i < ic->ngr; i++) {
+		for (j = 0; ic->gr[i].mem[j] != NULL; j++)
+			free(ic->gr[i].mem[j]);
+		free(ic->gr[i].mem);
+		free(ic->gr[i].name);
+	}
+	free(ic->gr);
+	ic->gr = NULL;
+	ic->ngr = 0;
+	memset(&ic->grstat, 0, sizeof(ic->grstat));
+}
+
+static int hyper_idcache_load_passwd(struct hyper_idcache *ic, FILE *file)
+{
+	struct hyper_pwent *pw;
+	struct passwd *pwd;
+
+	while ((pwd = fgetpwent(file)) != NULL) {
+		if (ic->npw % IDCACHE_GROW == 0) {
+			pw = realloc(ic->pw, (ic->npw + IDCACHE_GROW) * sizeof(*pw));
+			if (pw == NULL)
+				return -1;
+			ic->pw = pw;
+		}
+
+		pw = &ic->pw[ic->npw];
+		pw->name = strdup(pwd->pw_name);
+		pw->dir = strdup(pwd->pw_dir ? pwd->pw_dir : "");
+		if (pw->name == NULL || pw->dir == NULL) {
+			free(pw->name);
+			free(pw->dir);
+			return -1;
+		}
+		pw->uid = pwd->pw_uid;
+		pw->gid = pwd->pw_gid;
+		ic->npw++;
+	}
+
+	return 0;
+}
+
+static int hyper_idcache_load_group(struct hyper_idcache *ic, FILE *file)
+{
+	struct hyper_grent *gr;
+	struct group *grp;
+	int i, n;
+
+	while ((grp = fgetgrent(file)) != NULL) {
+		if (ic->ngr % IDCACHE_GROW == 0) {
+			gr = realloc(ic->gr, (ic->ngr + IDCACHE_GROW) * sizeof(*gr));
+			if (gr == NULL)
+				return -1;
+			ic->gr = gr;
+		}
+
+		for (n = 0; grp->gr_mem && grp->gr_mem[n]; n++)
+			;
+
+		gr = &ic->gr[ic->ngr];
+		gr->name = strdup(grp->gr_name);
+		gr->mem = calloc(n + 1, sizeof(*gr->mem));
+		if (gr->name == NULL || gr->mem == NULL)
+			goto fail;
+		for (i = 0; i < n; i++) {
+			gr->mem[i] = strdup(grp->gr_mem[i]);
+			if (gr->mem[i] == NULL)
+				goto fail;
+		}
+		gr->gid = grp->gr_gid;
+		ic->ngr++;
+	}
+
+	return 0;
+fail:
+	for (i = 0; gr->mem && gr->mem[i]; i++)
+		free(gr->mem[i]);
+	free(gr->mem);
+	free(gr->name);
+	return -1;
+}
+
+/* parse etc/name again if it changed, -1 if it can't be read here */
+static int hyper_idcache_update(struct hyper_idcache *ic, int etc, const char *name)
+{
+	int passwd = !strcmp(name, "passwd");
+	struct hyper_idstat *is = passwd ? &ic->pwstat : &ic->grstat;
+	struct stat st;
+	FILE *file;
+	int fd, ret;
+
+	if (fstatat(etc, name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+		fprintf(stderr, "stat /etc/%s failed: %s\n", name, strerror(errno));
+		return -1;
+	}
+	if (hyper_idstat_same(is, &st))
+		return 0;
+
+	fd = openat(etc, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0) {
+		fprintf(stderr, "open /etc/%s failed: %s\n", name, strerror(errno));
+		return -1;
+	}
+
+	file = fdopen(fd, "r");
+	if (file == NULL || fstat(fd, &st) < 0) {
+		fprintf(stderr, "read /etc/%s failed: %s\n", name, strerror(errno));
+		if (file != NULL)
+			fclose(file);
+		else
+			close(fd);
+		return -1;
+	}
+
+	fprintf(stdout, "load /etc/%s\n", name);
+	if (passwd) {
+		hyper_idcache_free_passwd(ic);
+		ret = hyper_idcache_load_passwd(ic, file);
+	} else {
+		hyper_idcache_free_group(ic);
+		ret = hyper_idcache_load_group(ic, file);
+	}
+	fclose(file);
+
+	if (ret < 0) {
+		fprintf(stderr, "parse /etc/%s failed\n", name);
+		if (passwd)
+			hyper_idcache_free_passwd(ic);
+		else
+			hyper_idcache_free_group(ic);
+		return -1;
+	}
+
+	hyper_idstat_set(is, &st);
+	return 0;
+}
+
+static struct hyper_pwent *hyper_idcache_getpw(struct hyper_idcache *ic, const char *name)
+{
+	uid_t uid = (uid_t)hyper_id_or_max(name);
+	int i;
+
+	for (i = 0; i < ic->npw; i++) {
+		if (!strcmp(ic->pw[i].name, name) || ic->pw[i].uid == uid)
+			return &ic->pw[i];
+	}
+
+	return NULL;
+}
+
+static struct hyper_grent *hyper_idcache_getgr(struct hyper_idcache *ic, const char *name)
+{
+	gid_t gid = (gid_t)hyper_id_or_max(name);
+	int i;
+
+	for (i = 0; i < ic->ngr; i++) {
+		if (!strcmp(ic->gr[i].name, name) || ic->gr[i].gid == gid)
+			return &ic->gr[i];
+	}
+
+	return NULL;
+}
+
+static int hyper_ids_add_group(struct hyper_ids *ids, gid_t gid)
+{
+	gid_t *groups = realloc(ids->groups, (ids->ngroups + 1) * sizeof(gid_t));
+
+	if (groups == NULL)
+		return -1;
+
+	groups[ids->ngroups++] = gid;
+	ids->groups = groups;
+	return 0;
+}
+
+/* the groups listing the user, its primary group if there is none */
+static int hyper_idcache_grouplist(struct hyper_idcache *ic, struct hyper_pwent *pw,
+				   struct hyper_ids *ids)
+{
+	int i, j;
+
+	for (i = 0; i < ic->ngr; i++) {
+		for (j = 0; ic->gr[i].mem[j] != NULL; j++) {
+			if (strcmp(ic->gr[i].mem[j], pw->name))
+				continue;
+			if (hyper_ids_add_group(ids, ic->gr[i].gid) < 0)
+				return -1;
+			break;
+		}
+	}
+
+	if (ids->ngroups == 0)
+		return hyper_ids_add_group(ids, pw->gid);
+
+	return 0;
+}
+
+/* what hyper_setup_exec_user() applies, -1 if it has to look them up itself */
+int hyper_idcache_resolve(struct hyper_idcache *ic, const char *user, const char *group,
+			  char **additional_groups, int nr_additional_groups,
+			  struct hyper_ids *ids)
+{
+	struct hyper_pwent *pw;
+	struct hyper_grent *gr;
+	int etc, i, ret = -1;
+
+	memset(ids, 0, sizeof(*ids));
+
+	etc = openat(ic->root, "etc", O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (etc < 0) {
+		perror("open etc directory failed");
+		return -1;
+	}
+
+	if ((user && hyper_idcache_update(ic, etc, "passwd") < 0) ||
+	    hyper_idcache_update(ic, etc, "group") < 0)
+		goto out;
+
+	if (user) {
+		pw = hyper_idcache_getpw(ic, user);
+		if (pw == NULL) {
+			fprintf(stderr, "can't find the user %s\n", user);
+			goto out;
+		}
+		ids->uid = pw->uid;
+		ids->gid = pw->gid;
+		ids->user = strdup(pw->name);
+		ids->home = strdup(pw->dir);
+		if (ids->user == NULL || ids->home == NULL ||
+		    hyper_idcache_grouplist(ic, pw, ids) < 0)
+			goto out;
+	} else {
+		ids->ngroups = getgroups(0, NULL);
+		if (ids->ngroups < 0)
+			goto out;
+		ids->groups = malloc((ids->ngroups + 1) * sizeof(gid_t));
+		if (ids->groups == NULL)
+			goto out;
+		ids->ngroups = getgroups(ids->ngroups, ids->groups);
+		if (ids->ngroups < 0)
+			goto out;
+	}
+
+	if (group) {
+		gr = hyper_idcache_getgr(ic, group);
+		if (gr == NULL) {
+			fprintf(stderr, "can't find the group %s\n", group);
+			goto out;
+		}
+		ids->gid = gr->gid;
+	}
+
+	for (i = 0; i < nr_additional_groups; i++) {
+		gr = hyper_idcache_getgr(ic, additional_groups[i]);
+		if (gr == NULL) {
+			fprintf(stderr, "can't find the group %s\n", additional_groups[i]);
+			goto out;
+		}
+		if (hyper_ids_add_group(ids, gr->gid) < 0)
+			goto out;
+	}
+
+	ret = 0;
+out:
+	close(etc);
+	if (ret < 0)
+		hyper_ids_free(ids);
+	return ret;
+}
+
+void hyper_ids_free(struct hyper_ids *ids)
+{
+	free(ids->groups);
+	free(ids->user);
+	free(ids->home);
+	memset(ids, 0, sizeof(*ids));
+}
+
+struct hyper_idcache *hyper_idcache_open(const char *root)
+{
+	struct hyper_idcache *ic;
+
+	ic = calloc(1, sizeof(*ic));
+	if (ic == NULL)
+		return NULL;
+
+	ic->root = open(root, O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (ic->root < 0) {
+		perror("open root of the passwd files failed");
+		free(ic);
+		return NULL;
+	}
+
+	return ic;
+}
+
+void hyper_idcache_free(struct hyper_idcache *ic)
+{
+	if (ic == NULL)
+		return;
+
+	hyper_idcache_free_passwd(ic);
+	hyper_idcache_free_group(ic);
+	close(ic->root);
+	free(ic);
+}
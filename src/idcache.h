@@ -0,0 +1,25 @@
+#ifndef _IDCACHE_H
+#define _IDCACHE_H
+
+#include <sys/types.h>
+
+/* the credentials of an exec, looked up before it is launched */
+struct hyper_ids {
+	uid_t	uid;
+	gid_t	gid;
+	gid_t	*groups;
+	int	ngroups;
+	char	*user;	// USER and HOME, NULL if no user is given
+	char	*home;
+};
+
+struct hyper_idcache;
+
+struct hyper_idcache *hyper_idcache_open(const char *root);
+void hyper_idcache_free(struct hyper_idcache *ic);
+int hyper_idcache_resolve(struct hyper_idcache *ic, const char *user, const char *group,
+			  char **additional_groups, int nr_additional_groups,
+			  struct hyper_ids *ids);
+void hyper_ids_free(struct hyper_ids *ids);
+
+#endif
@@ -19,6 +19,7 @@
 #include <inttypes.h>
 #include <ctype.h>
 #include <sys/prctl.h>
+#include <sys/signalfd.h>
 
 #include "../config.h"
 #include "hyper.h"
@@ -29,10 +30,15 @@
 #include "parse.h"
 #include "container.h"
 #include "syscall.h"
+#include "transport.h"
 
 static struct hyper_pod global_pod = {
 	.containers	=	LIST_HEAD_INIT(global_pod.containers),
 	.exec_head	=	LIST_HEAD_INIT(global_pod.exec_head),
+	.stop_grace	=	DESTROYPOD_GRACE,
+	.pidns		=	-1,
+	.utsns		=	-1,
+	.ipcns		=	-1,
 };
 
 #define MAXEVENTS	10
@@ -43,33 +49,59 @@ sigset_t orig_mask;
 
 static int hyper_handle_exit(struct hyper_pod *pod);
 
-static int hyper_set_win_size(struct hyper_pod *pod, char *json, int length)
+/*
+ * decode the payload of WINSIZE, SIGNALPROCESS and KILLCONTAINER. Binary
+ * strings point into @data, json ones are owned by @value, which must be
+ * freed by the caller.
+ */
+static int hyper_decode_process_cmd(struct hyper_process_cmd *cmd, JSON_Value **value,
+				    char *data, int length)
 {
+	JSON_Object *obj;
+
+	*value = NULL;
+	if (hyper_epoll.features & FEATURE_BINARY_CMD)
+		return hyper_parse_process_cmd_tlv(cmd, (uint8_t *)data, length);
+
+	fprintf(stdout, "%s, json %s, len %d\n", __func__, data, length);
+	*value = hyper_json_parse(data, length);
+	if (*value == NULL)
+		return -1;
+
+	obj = json_object(*value);
+	cmd->container = json_object_get_string(obj, "container");
+	cmd->process = json_object_get_string(obj, "process");
+	cmd->signal = (int)json_object_get_number(obj, "signal");
+	cmd->row = (int)json_object_get_number(obj, "row");
+	cmd->column = (int)json_object_get_number(obj, "column");
+	return 0;
+}
+
+static int hyper_set_win_size(struct hyper_pod *pod, char *data, int length)
+{
+	struct hyper_process_cmd cmd;
 	struct winsize size;
 	struct hyper_exec *exec;
+	JSON_Value *value;
 	int ret = -1;
 
-	fprintf(stdout, "call hyper_set_win_size, json %s, len %d\n", json, length);
-	JSON_Value *value = hyper_json_parse(json, length);
-	if (value == NULL) {
+	if (hyper_decode_process_cmd(&cmd, &value, data, length) < 0) {
 		fprintf(stderr, "set term size failed\n");
 		goto out;
 	}
-	const char *container = json_object_get_string(json_object(value), "container");
-	const char *process = json_object_get_string(json_object(value), "process");
-	if (!container || !process) {
+	if (!cmd.container || !cmd.process) {
 		fprintf(stderr, "call hyper_set_win_size, invalid config");
 		goto out;
 	}
 
-	exec = hyper_find_process(pod, container, process);
+	exec = hyper_find_process(pod, cmd.container, cmd.process);
 	if (!exec) {
-		fprintf(stderr, "call hyper_set_win_size, can not find the process: %s\n", process);
+		fprintf(stderr, "call hyper_set_win_size, can not find the process: %s\n", cmd.process);
 		goto out;
 	}
 
-	size.ws_row = (int)json_object_get_number(json_object(value), "row");
-	size.ws_col = (int)json_object_get_number(json_object(value), "column");
+	size.ws_row = cmd.row;
+	size.ws_col = cmd.column;
 
 	ret = ioctl(exec->ptyfd, TIOCSWINSZ, &size);
 	if (ret < 0)
@@ -80,49 +112,7 @@ out:
 	return ret;
 }
 
-static void hyper_kill_process(int pid)
-{
-	char path[64];
-	char *line = NULL, *ignore = "SigIgn:";
-	size_t len = 0;
-	ssize_t read;
-	FILE *file;
-	char *sub;
-
-	sprintf(path, "/proc/%u/status", pid);
-
-	fprintf(stdout, "fopen %s\n", path);
-	file = fopen(path, "r");
-	if (file == NULL) {
-		perror("can not open process proc status file");
-		return;
-	}
-
-	while ((read = getline(&line, &len, file)) != -1) {
-		long mask;
-
-		if (strstr(line, ignore) == NULL)
-			continue;
-
-		sub = line + strlen(ignore);
-		fprintf(stdout, "find sigign %s", sub);
-
-		mask = atol(sub);
-		fprintf(stdout, "mask is %ld\n", mask);
-
-		if ((mask >> (SIGTERM - 1)) & 0x1) {
-			fprintf(stdout, "signal term is ignored, kill it\n");
-			kill(pid, SIGKILL);
-		}
-
-		break;
-	}
-
-	fclose(file);
-	free(line);
-}
-
-static void hyper_term_all(struct hyper_pod *pod)
+static void hyper_signal_all(int sig)
 {
 	int npids = 0;
 	int index = 0;
@@ -130,7 +120,6 @@ static void hyper_term_all(struct hyper_pod *pod)
 	DIR *dp;
 	struct dirent *de;
 	pid_t *pids = NULL;
-	struct hyper_exec *e;
 
 	dp = opendir("/proc");
 	if (dp == NULL)
@@ -152,26 +141,66 @@ static void hyper_term_all(struct hyper_pod *pod)
 		pids[index++] = pid;
 	}
 
-	fprintf(stdout, "Sending SIGTERM\n");
+	fprintf(stdout, "Sending signal %d\n", sig);
 
 	for (--index; index >= 0; --index) {
-		kill(pids[index], SIGTERM);
+		kill(pids[index], sig);
 	}
 
 	free(pids);
 	closedir(dp);
+}
+
+/* the grace period is over, kill whatever ignored SIGTERM */
+static void hyper_stop_expire(struct hyper_timer *t)
+{
+	hyper_signal_all(SIGKILL);
+}
+
+/* SIGTERM everything, what ignores it gets SIGKILL after the grace period */
+static void hyper_term_all(struct hyper_pod *pod)
+{
+	hyper_signal_all(SIGTERM);
 
-	list_for_each_entry(e, &pod->exec_head, list)
-		hyper_kill_process(e->pid);
+	fprintf(stdout, "SIGKILL in %" PRIu32 "ms\n", pod->stop_grace);
+	hyper_timer_add(&pod->stop_timer, pod->stop_grace, hyper_stop_expire);
+}
+
+/* a helper process whose exit finishes some work, e.g. a deferred command */
+struct hyper_child {
+	struct list_head	list;
+	int			pid;
+	void			(*exit)(struct hyper_child *child, int status);
+	void			*ptr;
+};
+
+static LIST_HEAD(hyper_children);
+
+static int hyper_handle_child_exit(int pid, int status)
+{
+	struct hyper_child *child;
+
+	list_for_each_entry(child, &hyper_children, list) {
+		if (child->pid != pid)
+			continue;
+
+		list_del(&child->list);
+		child->exit(child, status);
+		free(child);
+		return 1;
+	}
+
+	return 0;
 }
 
 static int hyper_handle_exit(struct hyper_pod *pod)
 {
-	int pid, status;
+	int pid, status, reaped = 0;
 	/* pid + exit code */
 	uint8_t data[5];
 
 	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		reaped++;
 		data[4] = 0;
 
 		if (WIFEXITED(status)) {
@@ -184,23 +213,43 @@ static int hyper_handle_exit(struct hyper_pod *pod)
 				pid, WTERMSIG(status));
 		}
 
+		if (pod && hyper_handle_child_exit(pid, status))
+			continue;
+
 		if (pod && hyper_handle_exec_exit(pod, pid, data[4]) < 0)
 			fprintf(stderr, "signal_loop send eof failed\n");
 	}
 
+	dprintf(stdout, "%s reaped %d children\n", __func__, reaped);
 	return 0;
 }
 
-static void pod_init_sigchld(int sig)
+/*
+ * SIGCHLD stays blocked in hyperstart and is read from a signalfd, exits
+ * are handled like any other event. Several exits may be merged into one
+ * signal, so drain the signalfd and reap all exited children at once.
+ */
+static int hyper_sigchld_read(struct hyper_event *he, int efd, int events)
 {
-	hyper_handle_exit(NULL);
-}
+	struct signalfd_siginfo info[16];
+	ssize_t size;
 
-static void hyper_init_sigchld(int sig)
-{
-	hyper_handle_exit(&global_pod);
+	do {
+		size = read(he->fd, info, sizeof(info));
+	} while (size == sizeof(info) || (size < 0 && errno == EINTR));
+
+	if (size < 0 && errno != EAGAIN) {
+		perror("read signalfd failed");
+		return -1;
+	}
+
+	return hyper_handle_exit(he->ptr);
 }
 
+static struct hyper_event_ops hyper_sigchld_ops = {
+	.read		= hyper_sigchld_read,
+};
+
 struct hyper_pod_arg {
 	struct hyper_pod	*pod;
 	int		ctl_pipe[2];
@@ -211,19 +260,23 @@ static int hyper_pod_init(void *data)
 	struct hyper_pod_arg *arg = data;
 	struct hyper_pod *pod = arg->pod;
 	sigset_t mask;
+	int i;
 
 	close(arg->ctl_pipe[0]);
 	close(hyper_epoll.efd);
 	close(hyper_epoll.ctl.fd);
-	close(hyper_epoll.tty.fd);
+	close(hyper_epoll.sigchld.fd);
+	close(hyper_epoll.timer.fd);
+	for (i = 0; i < hyper_epoll.tty_num; i++)
+		close(hyper_epoll.tty[i].ev.fd);
 
+	// SIGCHLD is inherited blocked from the loop, wait for it synchronously
 	sigemptyset(&mask);
 	sigaddset(&mask, SIGCHLD);
-	if (sigprocmask(SIG_UNBLOCK, &mask, NULL) < 0) {
+	if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0) {
 		perror("sigprocmask SIGCHLD failed");
 		return -1;
 	}
-	signal(SIGCHLD, pod_init_sigchld);
 
 	/* mount new proc directory */
 	if (umount("/proc") < 0) {
@@ -248,8 +301,14 @@ static int hyper_pod_init(void *data)
 
 	close(arg->ctl_pipe[1]);
 
-	for (;;)
-		pause(); /* infinite loop and handle SIGCHLD */
+	/* infinite loop and reap the orphans */
+	for (;;) {
+		if (sigwaitinfo(&mask, NULL) < 0 && errno != EINTR) {
+			perror("wait for SIGCHLD failed");
+			goto out;
+		}
+		hyper_handle_exit(NULL);
+	}
 out:
 	_exit(-1);
 
@@ -260,18 +319,30 @@ fail:
 	goto out;
 }
 
-static int hyper_start_containers(struct hyper_pod *pod)
+/* open the namespaces of pod init once, every process of the pod joins them */
+static int hyper_open_pod_ns(struct hyper_pod *pod)
 {
-	struct hyper_container *c;
+	char path[512];
 
-	// TODO: setup containers and run container init processes
-	//       via separated hyperstart APIs
-	list_for_each_entry(c, &pod->containers, list) {
-		if (hyper_setup_container(c, pod) < 0)
-			return -1;
-		if (hyper_run_process(&c->exec) < 0)
-			return -1;
-		pod->remains++;
+	sprintf(path, "/proc/%d/ns/pid", pod->init_pid);
+	pod->pidns = open(path, O_RDONLY| O_CLOEXEC);
+	if (pod->pidns < 0) {
+		perror("fail to open pidns of pod init");
+		return -1;
+	}
+
+	sprintf(path, "/proc/%d/ns/uts", pod->init_pid);
+	pod->utsns = open(path, O_RDONLY| O_CLOEXEC);
+	if (pod->utsns < 0) {
+		perror("fail to open utsns of pod init");
+		return -1;
+	}
+
+	sprintf(path, "/proc/%d/ns/ipc", pod->init_pid);
+	pod->ipcns = open(path, O_RDONLY| O_CLOEXEC);
+	if (pod->ipcns < 0) {
+		perror("fail to open ipcns of pod init");
+		return -1;
 	}
 
 	return 0;
@@ -325,7 +396,7 @@ static int hyper_setup_pod_init(struct hyper_pod *pod)
 	}
 
 	pod->init_pid = init_pid;
-	ret = 0;
+	ret = hyper_open_pod_ns(pod);
 out:
 	close(arg.ctl_pipe[1]);
 	close(arg.ctl_pipe[0]);
@@ -335,35 +406,13 @@ out:
 // enter the sanbox and pass to the child, shouldn't call from the init process
 int hyper_enter_sandbox(struct hyper_pod *pod, int pidpipe)
 {
-	int ret = -1, pidns = -1, utsns = -1, ipcns = -1;
-	char path[512];
-
-	sprintf(path, "/proc/%d/ns/pid", pod->init_pid);
-	pidns = open(path, O_RDONLY| O_CLOEXEC);
-	if (pidns < 0) {
-		perror("fail to open pidns of pod init");
-		goto out;
-	}
-
-	sprintf(path, "/proc/%d/ns/uts", pod->init_pid);
-	utsns = open(path, O_RDONLY| O_CLOEXEC);
-	if (utsns < 0) {
-		perror("fail to open utsns of pod init");
-		goto out;
-	}
-
-	sprintf(path, "/proc/%d/ns/ipc", pod->init_pid);
-	ipcns = open(path, O_RDONLY| O_CLOEXEC);
-	if (ipcns < 0) {
-		perror("fail to open ipcns of pod init");
-		goto out;
-	}
+	int ret = -1;
 
-	if (setns(pidns, CLONE_NEWPID) < 0 ||
-	    setns(utsns, CLONE_NEWUTS) < 0 ||
-	    setns(ipcns, CLONE_NEWIPC) < 0) {
+	if (setns(pod->pidns, CLONE_NEWPID) < 0 ||
+	    setns(pod->utsns, CLONE_NEWUTS) < 0 ||
+	    setns(pod->ipcns, CLONE_NEWIPC) < 0) {
 		perror("fail to enter the sandbox");
-		goto out;
+		return -1;
 	}
 
 	/* current process isn't in the pidns even setns(pidns, CLONE_NEWPID)
@@ -372,7 +421,6 @@ int hyper_enter_sandbox(struct hyper_pod *pod, int pidpipe)
 	ret = fork();
 	if (ret < 0) {
 		perror("fail to fork");
-		goto out;
 	} else if (ret > 0) {
 		fprintf(stdout, "create child process pid=%d in the sandbox\n", ret);
 		if (pidpipe > 0) {
@@ -381,11 +429,6 @@ int hyper_enter_sandbox(struct hyper_pod *pod, int pidpipe)
 		_exit(0);
 	}
 
-out:
-	close(pidns);
-	close(ipcns);
-	close(utsns);
-
 	return ret;
 }
 
@@ -542,19 +585,39 @@ static void hyper_print_uptime(void)
 	close(fd);
 }
 
+static void hyper_flush_buf(int fd, struct hyper_buf *buf)
+{
+	struct iovec iov[2];
+	int i, n;
+
+	n = hyper_buf_iov(buf, 0, buf->get, iov);
+	for (i = 0; i < n; i++)
+		hyper_send_data_block(fd, iov[i].iov_base, iov[i].iov_len);
+}
+
 static void hyper_flush_channel()
 {
-	// Todo: remove this after we implement DESTROYVM message.
-	struct hyper_buf *ctl_buf = &hyper_epoll.ctl.wbuf;
-	struct hyper_buf *tty_buf = &hyper_epoll.tty.wbuf;
+	struct hyper_tty *tty;
+	int i;
 
-	hyper_send_data_block(hyper_epoll.ctl.fd, ctl_buf->data, ctl_buf->get);
-	hyper_send_data_block(hyper_epoll.tty.fd, tty_buf->data, tty_buf->get);
+	// Todo: remove this after we implement DESTROYVM message.
+	hyper_flush_buf(hyper_epoll.ctl.fd, &hyper_epoll.ctl.wbuf);
+	for (i = 0; i < hyper_epoll.tty_num; i++) {
+		tty = &hyper_epoll.tty[i];
+		hyper_splice_finish(tty);
+		hyper_flush_buf(tty->ev.fd, &tty->ev.wbuf);
+	}
 }
 
 void hyper_pod_destroyed(int failed)
 {
-	hyper_ctl_append_msg(&hyper_epoll.ctl, failed?ERROR:ACK, NULL, 0);
+	int i;
+
+	if (global_pod.destroy_num == 0)
+		hyper_ctl_append_msg(&hyper_epoll.ctl, failed?ERROR:ACK, NULL, 0);
+	for (i = 0; i < global_pod.destroy_num; i++)
+		hyper_ctl_complete(global_pod.destroy_reqs[i], failed ? -1 : 0, NULL, 0);
+	global_pod.destroy_num = 0;
 	// Todo: this doesn't make sure peer receives the data
 	hyper_flush_channel();
 	// Todo: don't shutdown vm until hyperstart receives the DESTROYVM message,
@@ -562,6 +625,26 @@ void hyper_pod_destroyed(int failed)
 	hyper_shutdown();
 }
 
+/* keep the DESTROYPOD being dispatched for hyper_pod_destroyed() */
+static void hyper_destroy_pod_defer(struct hyper_pod *pod)
+{
+	struct hyper_ctl_request **reqs, *req;
+
+	req = hyper_ctl_defer();
+	if (req == NULL)
+		return;
+
+	reqs = realloc(pod->destroy_reqs, (pod->destroy_num + 1) * sizeof(*reqs));
+	if (reqs == NULL) {
+		fprintf(stderr, "allocate destroy request failed\n");
+		hyper_ctl_complete(req, -1, NULL, 0);
+		return;
+	}
+
+	reqs[pod->destroy_num++] = req;
+	pod->destroy_reqs = reqs;
+}
+
 static int hyper_destroy_pod(struct hyper_pod *pod, int error)
 {
 	if (pod->init_pid == 0 || pod->remains == 0) {
@@ -574,8 +657,86 @@ static int hyper_destroy_pod(struct hyper_pod *pod, int error)
 	return 0;
 }
 
+static void hyper_start_pod_finish(struct hyper_pod *pod, struct hyper_ctl_request *req, int ret)
+{
+	if (ret < 0) {
+		fprintf(stderr, "start containers failed\n");
+		if (!pod->req_destroy)
+			hyper_destroy_pod(pod, 1);
+	}
+
+	hyper_ctl_complete(req, ret, NULL, 0);
+}
+
+static void hyper_start_container_done(struct hyper_container *c, int ret, void *data);
+
+/* the init of c was launched while the pod is being destroyed */
+static void hyper_container_run_late(struct hyper_container *c, void *data)
+{
+	fprintf(stderr, "container %s started while destroying the pod\n", c->id);
+	hyper_exec_signal(&c->exec, SIGKILL);
+	hyper_ctl_complete(data, -1, NULL, 0);
+}
+
+/*
+ * TODO: setup containers and run container init processes via separated
+ * hyperstart APIs. Until then they are set up one after another, each
+ * one from the done callback of the previous one.
+ */
+static int hyper_start_containers(struct hyper_pod *pod, struct hyper_container *c,
+				  struct hyper_ctl_request *req)
+{
+	return hyper_setup_container(c, pod, hyper_start_container_done, req);
+}
+
+static void hyper_start_container_run(struct hyper_exec *exec, int ret, void *data)
+{
+	struct hyper_container *c = container_of(exec, struct hyper_container, exec);
+	struct hyper_pod *pod = exec->pod;
+
+	if (ret < 0) {
+		pod->remains--;
+		hyper_start_pod_finish(pod, data, -1);
+		if (pod->req_destroy && pod->remains == 0)
+			hyper_pod_destroyed(0);
+		return;
+	}
+
+	if (pod->req_destroy) {
+		hyper_container_run_late(c, data);
+		return;
+	}
+
+	if (c->list.next == &pod->containers) {
+		hyper_start_pod_finish(pod, data, 0);
+		return;
+	}
+
+	c = list_entry(c->list.next, struct hyper_container, list);
+	if (hyper_start_containers(pod, c, data) < 0)
+		hyper_start_pod_finish(pod, data, -1);
+}
+
+static void hyper_start_container_done(struct hyper_container *c, int ret, void *data)
+{
+	struct hyper_pod *pod = c->exec.pod;
+
+	/* counted from the launch on, so a DESTROYPOD meanwhile waits for it */
+	if (ret == 0 && !pod->req_destroy) {
+		pod->remains++;
+		if (hyper_run_process(&c->exec, hyper_start_container_run, data) == 0)
+			return;
+		pod->remains--;
+	}
+
+	hyper_start_pod_finish(pod, data, -1);
+}
+
 static int hyper_start_pod(struct hyper_pod *pod, char *json, int length)
 {
+	struct hyper_ctl_request *req;
+	struct hyper_container *c;
+
 	fprintf(stdout, "call hyper_start_pod, json %s, len %d\n", json, length);
 
 	if (pod->init_pid)
@@ -592,18 +753,64 @@ static int hyper_start_pod(struct hyper_pod *pod, char *json, int length)
 		return -1;
 	}
 
-	if (hyper_start_containers(pod) < 0) {
-		fprintf(stderr, "start containers failed\n");
+	if (list_empty(&pod->containers))
+		return 0;
+
+	/* replied once the last container runs */
+	req = hyper_ctl_defer();
+	if (req == NULL) {
 		hyper_destroy_pod(pod, 1);
 		return -1;
 	}
 
+	c = list_first_entry(&pod->containers, struct hyper_container, list);
+	if (hyper_start_containers(pod, c, req) < 0)
+		hyper_start_pod_finish(pod, req, -1);
+
 	return 0;
 }
 
+static void hyper_new_container_run(struct hyper_exec *exec, int ret, void *data)
+{
+	struct hyper_container *c = container_of(exec, struct hyper_container, exec);
+	struct hyper_pod *pod = exec->pod;
+
+	if (ret < 0) {
+		//TODO full grace cleanup
+		hyper_cleanup_container(c, pod);
+		hyper_ctl_complete(data, ret, NULL, 0);
+		if (--pod->remains == 0 && pod->req_destroy)
+			hyper_pod_destroyed(0);
+		return;
+	}
+
+	if (pod->req_destroy) {
+		hyper_container_run_late(c, data);
+		return;
+	}
+
+	hyper_ctl_complete(data, ret, NULL, 0);
+}
+
+static void hyper_new_container_done(struct hyper_container *c, int ret, void *data)
+{
+	struct hyper_pod *pod = c->exec.pod;
+
+	if (ret == 0 && !pod->req_destroy) {
+		pod->remains++;
+		if (hyper_run_process(&c->exec, hyper_new_container_run, data) == 0)
+			return;
+		pod->remains--;
+	}
+
+	//TODO full grace cleanup
+	hyper_cleanup_container(c, pod);
+	hyper_ctl_complete(data, -1, NULL, 0);
+}
+
 static int hyper_new_container(struct hyper_pod *pod, char *json, int length)
 {
-	int ret;
+	struct hyper_ctl_request *req;
 	struct hyper_container *c;
 
 	fprintf(stdout, "call hyper_new_container, json %s, len %d\n", json, length);
@@ -625,64 +832,66 @@ static int hyper_new_container(struct hyper_pod *pod, char *json, int length)
 		return -1;
 	}
 
-	list_add_tail(&c->list, &pod->containers);
-	ret = hyper_setup_container(c, pod);
-	if (ret >= 0)
-		ret = hyper_run_process(&c->exec);
+	hyper_add_container(pod, c);
 
-	if (ret < 0) {
-		//TODO full grace cleanup
+	/* replied once the container runs */
+	req = hyper_ctl_defer();
+	if (req == NULL) {
 		hyper_cleanup_container(c, pod);
-	} else {
-		pod->remains++;
+		return -1;
 	}
 
-	return ret;
+	if (hyper_setup_container(c, pod, hyper_new_container_done, req) < 0)
+		hyper_new_container_done(c, -1, req);
+
+	return 0;
 }
 
-static int hyper_kill_container(struct hyper_pod *pod, char *json, int length)
+static int hyper_kill_container(struct hyper_pod *pod, char *data, int length)
 {
+	struct hyper_process_cmd cmd;
 	struct hyper_container *c;
+	JSON_Value *value;
 	int ret = -1;
 
-	JSON_Value *value = hyper_json_parse(json, length);
-	if (value == NULL) {
+	if (hyper_decode_process_cmd(&cmd, &value, data, length) < 0 || cmd.container == NULL) {
 		goto out;
 	}
 
-	const char *id = json_object_get_string(json_object(value), "container");
-	c = hyper_find_container(pod, id);
+	c = hyper_find_container(pod, cmd.container);
 	if (c == NULL) {
-		fprintf(stderr, "can not find container whose id is %s\n", id);
+		fprintf(stderr, "can not find container whose id is %s\n", cmd.container);
 		goto out;
 	}
 
-	kill(c->exec.pid, (int)json_object_get_number(json_object(value), "signal"));
+	if (hyper_exec_signal(&c->exec, cmd.signal) < 0)
+		perror("signal container init failed");
 	ret = 0;
 out:
 	json_value_free(value);
 	return ret;
 }
 
-static int hyper_signal_process(struct hyper_pod *pod, char *json, int length)
+static int hyper_signal_process(struct hyper_pod *pod, char *data, int length)
 {
+	struct hyper_process_cmd cmd;
 	struct hyper_exec *exec;
+	JSON_Value *value;
 	int ret = -1;
 
-	JSON_Value *value = hyper_json_parse(json, length);
-	if (value == NULL) {
+	if (hyper_decode_process_cmd(&cmd, &value, data, length) < 0 ||
+	    cmd.container == NULL || cmd.process == NULL) {
 		goto out;
 	}
 
-	const char *container = json_object_get_string(json_object(value), "container");
-	const char *process = json_object_get_string(json_object(value), "process");
-	exec = hyper_find_process(pod, container, process);
+	exec = hyper_find_process(pod, cmd.container, cmd.process);
 	if (exec == NULL) {
 		fprintf(stderr, "can not find process");
 		goto out;
 	}
 
-	kill(exec->pid, (int)json_object_get_number(json_object(value), "signal"));
+	if (hyper_exec_signal(exec, cmd.signal) < 0)
+		perror("signal process failed");
 	ret = 0;
 out:
 	json_value_free(value);
@@ -791,8 +1000,8 @@ static int hyper_cmd_rw_file(struct hyper_pod *pod, char *json, int length, uint
 	arg.file = cmd.file;
 
 	c = hyper_find_container(pod, cmd.id);
-	if (c == NULL) {
-		fprintf(stderr, "can not find container whose id is %s\n", cmd.id);
+	if (c == NULL || c->setup) {
+		fprintf(stderr, "can not find ready container whose id is %s\n", cmd.id);
 		goto out;
 	}
 
@@ -875,83 +1084,262 @@ out:
 	return ret;
 }
 
-static void hyper_cmd_online_cpu_mem()
+/*
+ * hot plugged cpus and memory may not be ready at once, retry a few times
+ * while some are still offline. The reply is ACK anyway, what is left
+ * offline is only logged.
+ */
+#define ONLINE_TRIES		5
+#define ONLINE_RETRY_DELAY	200
+
+struct hyper_online {
+	struct hyper_ctl_request	*req;
+	struct hyper_timer		timer;
+	int				tries;
+};
+
+static int hyper_online_fork(struct hyper_online *online);
+
+static void hyper_online_done(struct hyper_online *online)
 {
-	int pid = fork();
-	if (pid < 0) {
+	if (online->req)
+		hyper_ctl_complete(online->req, 0, NULL, 0);
+	free(online);
+}
+
+static void hyper_online_retry(struct hyper_timer *t)
+{
+	struct hyper_online *online = container_of(t, struct hyper_online, timer);
+
+	if (hyper_online_fork(online) < 0)
+		hyper_online_done(online);
+}
+
+static void hyper_online_cpu_mem_exit(struct hyper_child *child, int status)
+{
+	struct hyper_online *online = child->ptr;
+
+	if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+		hyper_online_done(online);
+		return;
+	}
+
+	if (++online->tries < ONLINE_TRIES) {
+		fprintf(stdout, "some cpu or memory still offline, retry in %dms\n",
+			ONLINE_RETRY_DELAY);
+		hyper_timer_add(&online->timer, ONLINE_RETRY_DELAY, hyper_online_retry);
+		return;
+	}
+
+	fprintf(stderr, "some cpu or memory still offline after %d tries\n", online->tries);
+	hyper_online_done(online);
+}
+
+static int hyper_online_fork(struct hyper_online *online)
+{
+	struct hyper_child *child = calloc(1, sizeof(*child));
+
+	if (child == NULL) {
+		fprintf(stderr, "allocate online process failed\n");
+		return -1;
+	}
+
+	child->pid = fork();
+	if (child->pid < 0) {
 		perror("fail to fork online process");
-	} else if (pid == 0) {
-		online_cpu();
-		online_memory();
-		exit(0);
+		free(child);
+		return -1;
+	} else if (child->pid == 0) {
+		int failed = online_cpu();
+
+		failed += online_memory();
+		exit(failed ? 1 : 0);
 	}
+
+	child->ptr = online;
+	child->exit = hyper_online_cpu_mem_exit;
+	list_add_tail(&child->list, &hyper_children);
+	return 0;
 }
 
-static int hyper_setup_ctl_channel(char *name)
+// reply when the online process finishes
+static int hyper_cmd_online_cpu_mem()
+{
+	struct hyper_online *online = calloc(1, sizeof(*online));
+
+	if (online == NULL) {
+		fprintf(stderr, "allocate online request failed\n");
+		return -1;
+	}
+
+	if (hyper_online_fork(online) < 0) {
+		free(online);
+		return -1;
+	}
+
+	// NULL if it can't be deferred, then the reply goes out right now
+	online->req = hyper_ctl_defer();
+	return 0;
+}
+
+static int hyper_send_ready(int fd)
 {
 	uint8_t buf[8];
-	int ret = hyper_open_channel(name, 0);
-	if (ret < 0)
-		return ret;
 
 	fprintf(stdout, "send ready message\n");
 	hyper_set_be32(buf, READY);
 	hyper_set_be32(buf + 4, 8);
-	if (hyper_send_data_block(ret, buf, 8) < 0) {
+	if (hyper_send_data_block(fd, buf, 8) < 0) {
 		perror("send READY MESSAGE failed\n");
-		goto out;
+		return -1;
 	}
 
+	return 0;
+}
+
+static int hyper_setup_ctl_channel(void)
+{
+	int ret = hyper_transport_open(HYPER_CHANNEL_CTL, 0);
+	if (ret < 0)
+		return ret;
+
+	if (hyper_send_ready(ret) < 0)
+		goto out;
+
 	return ret;
 out:
 	close(ret);
 	return -1;
 }
 
-static int hyper_setup_tty_channel(char *name)
+static int hyper_setup_tty_channel(void)
 {
-	int ret = hyper_open_channel(name, O_NONBLOCK);
-	if (ret < 0)
+	struct hyper_tty *tty = hyper_epoll.tty;
+	int fd;
+
+	tty[0].ev.fd = hyper_transport_open(HYPER_CHANNEL_TTY, O_NONBLOCK);
+	if (tty[0].ev.fd < 0)
 		return -1;
 
-	return ret;
+	hyper_epoll.tty_num = 1;
+#ifndef WITH_VBOX
+	// the host may give more stream ports, sh.hyper.channel.2 and on
+	while (hyper_epoll.tty_num < HYPER_TTY_MAX) {
+		fd = hyper_transport_open(HYPER_CHANNEL_TTY + hyper_epoll.tty_num, O_NONBLOCK);
+		if (fd < 0)
+			break;
+		tty[hyper_epoll.tty_num++].ev.fd = fd;
+	}
+#endif
+	fprintf(stdout, "%d tty ports\n", hyper_epoll.tty_num);
+
+	return 0;
+}
+
+/* listening sockets of the channels whose peer has gone */
+static struct hyper_event hyper_listen_events[HYPER_CHANNEL_NUM];
+
+/*
+ * bumped when the ctl peer reconnects, the replies of deferred requests
+ * from an earlier connection are dropped, its framing may differ.
+ */
+static uint32_t hyper_ctl_session;
+
+static int hyper_channel_accept(struct hyper_event *le, int efd, int events)
+{
+	struct hyper_event *he = le->ptr;
+	int idx = le - hyper_listen_events;
+	int fd;
+
+	fd = hyper_transport_accept(idx);
+	if (fd < 0)
+		return 0;
+
+	fprintf(stdout, "peer of channel %d is connected\n", idx);
+	if (hyper_del_event(efd, le) < 0)
+		perror("epoll_ctl del listening socket failed");
+
+	// a new session, it negotiates the features again
+	if (he == &hyper_epoll.ctl) {
+		hyper_epoll.features = 0;
+		hyper_epoll.ctl_credit = 0;
+		hyper_ctl_session++;
+		// what is queued was framed for the old peer
+		he->wbuf.head = 0;
+		he->wbuf.get = 0;
+		if (hyper_setfd_block(fd) < 0 || hyper_send_ready(fd) < 0) {
+			close(fd);
+			return hyper_add_event(efd, le, EPOLLIN);
+		}
+	}
+
+	he->fd = fd;
+	he->hup = 0;
+	he->rbuf.get = 0;
+	if (hyper_add_event(efd, he, he->flag | EPOLLIN) < 0) {
+		fprintf(stderr, "add channel %d event failed\n", idx);
+		return -1;
+	}
+
+	return 0;
+}
+
+static struct hyper_event_ops hyper_listen_ops = {
+	.read		= hyper_channel_accept,
+};
+
+/*
+ * the peer of a connection based channel has gone, keep the buffered
+ * output and wait for the next connection.
+ */
+static int hyper_channel_disconnect(struct hyper_event *he, int efd)
+{
+	int idx = he == &hyper_epoll.ctl ? HYPER_CHANNEL_CTL : HYPER_CHANNEL_TTY;
+	struct hyper_event *le = &hyper_listen_events[idx];
+
+	if (he != &hyper_epoll.ctl)
+		hyper_splice_finish(container_of(he, struct hyper_tty, ev));
+
+	if (hyper_del_event(efd, he) < 0)
+		perror("epoll_ctl del channel failed");
+	close(he->fd);
+	he->fd = -1;
+	he->hup = 1;
+
+	if (hyper_init_event(le, &hyper_listen_ops, he) < 0)
+		return -1;
+
+	le->fd = hyper_transport_listen_fd(idx);
+	return hyper_add_event(efd, le, EPOLLIN);
 }
 
-static int hyper_ttyfd_handle(struct hyper_event *de, uint32_t len)
+static int hyper_ttyfd_handle(struct hyper_event *de, uint8_t *frame, uint32_t len)
 {
-	struct hyper_buf *rbuf = &de->rbuf;
 	struct hyper_pod *pod = de->ptr;
 	struct hyper_exec *exec;
 	struct hyper_buf *wbuf;
 	uint64_t seq = 0;
-	int size;
+	uint8_t *data;
+	int size, written;
 
-	seq = hyper_get_be64(rbuf->data);
+	seq = hyper_get_be64(frame);
 
-	fprintf(stdout, "\n%s seq %" PRIu64", len %" PRIu32"\n", __func__, seq, len - 12);
+	dprintf(stdout, "%s seq %" PRIu64", len %" PRIu32"\n", __func__, seq, len - 12);
 
 	exec = hyper_find_exec_by_seq(pod, seq);
 	if (exec == NULL) {
-		wbuf = &de->wbuf;
+		uint8_t bye[STREAM_HEADER_SIZE];
 		fprintf(stderr, "can't find exec whose seq is %" PRIu64 "\n", seq);
 
 		/* goodbye */
-		if (wbuf->get + 12 > wbuf->size)
-			return 0;
-
-		hyper_set_be64(wbuf->data + wbuf->get, seq);
-		hyper_set_be32(wbuf->data + wbuf->get + 8, 12);
-		wbuf->get += 12;
-
-		if (hyper_modify_event(hyper_epoll.efd, de, EPOLLIN | EPOLLOUT) < 0) {
-			fprintf(stderr, "modify ctl tty event to in & out failed\n");
-			return -1;
-		}
+		hyper_set_be64(bye, seq);
+		hyper_set_be32(bye + STREAM_HEADER_LENGTH_OFFSET, sizeof(bye));
+		hyper_wbuf_append_msg(de, bye, sizeof(bye));
 
 		return 0;
 	}
 
-	fprintf(stdout, "find exec %s pid %d, seq is %" PRIu64 "\n",
+	dprintf(stdout, "find exec %s pid %d, seq is %" PRIu64 "\n",
 		exec->container_id ? exec->container_id : "pod", exec->pid, exec->seq);
 	// if exec is exited or stdin is closed by process, the event fd of exec is invalid.
 	// don't accept any input.
@@ -973,13 +1361,36 @@ static int hyper_ttyfd_handle(struct hyper_event *de, uint32_t len)
 	}
 
 	wbuf = &exec->stdinev.wbuf;
+	data = frame + STREAM_HEADER_SIZE;
+	if (size > 0 && wbuf->get == 0) {
+		/* nothing queued, write straight from the channel buffer */
+		do {
+			written = write(exec->stdinev.fd, data, size);
+		} while (written < 0 && errno == EINTR);
+
+		if (written > 0) {
+			data += written;
+			size -= written;
+			hyper_exec_stdin_consumed(exec, written);
+		}
+	}
+
+	if (size > 0 && (hyper_epoll.features & FEATURE_STREAM_CREDIT)) {
+		/* the host keeps to the window, queue everything */
+		if (wbuf->get + size > STREAM_CREDIT_WINDOW) {
+			fprintf(stderr, "seq %" PRIu64 " exceeds stdin window, discard\n", seq);
+			return 0;
+		}
+		return hyper_wbuf_append_msg(&exec->stdinev, data, size);
+	}
+
 	if (size > (wbuf->size - wbuf->get)) {
 		/* buffer is full, discard the data */
 		/* TODO: properly handle the discard data */
 		size = wbuf->size - wbuf->get;
 	}
 	if (size > 0) {
-		memcpy(wbuf->data + wbuf->get, rbuf->data + 12, size);
+		hyper_buf_write(wbuf, wbuf->get, data, size);
 		wbuf->get += size;
 		if (hyper_modify_event(hyper_epoll.efd, &exec->stdinev, EPOLLOUT) < 0) {
 			fprintf(stderr, "modify exec pts event to in & out failed\n");
@@ -990,19 +1401,33 @@ static int hyper_ttyfd_handle(struct hyper_event *de, uint32_t len)
 	return 0;
 }
 
-static ssize_t hyper_channel_read(struct hyper_event *he, int efd, int len, int events)
+/* read what is available into the free part of rbuf, one read per wakeup */
+static ssize_t hyper_channel_read(struct hyper_event *he, int efd, int events)
 {
 	struct hyper_buf *buf = &he->rbuf;
 	ssize_t size;
 
-	size = nonblock_read(he->fd, buf->data + buf->get, len);
-	if (size < 0)
+	do {
+		size = read(he->fd, buf->data + buf->get, buf->size - buf->get);
+	} while (size < 0 && errno == EINTR);
+
+	if (size < 0) {
+		if (errno == EAGAIN)
+			return 0;
+		perror("read channel failed");
 		goto out;
+	}
 
 	// check if peer is dissapeared
 	if ((size == 0) && (events & EPOLLHUP)) {
-		he->hup = 1;
 		fprintf(stdout, "peer is disappeared\n");
+		if (hyper_transport_listen_fd(he == &hyper_epoll.ctl ?
+					      HYPER_CHANNEL_CTL : HYPER_CHANNEL_TTY) >= 0) {
+			if (hyper_channel_disconnect(he, efd) < 0)
+				return -1;
+			goto out;
+		}
+		he->hup = 1;
 		// use EPOLLOUT| EPOLLET event to check if peer disappeared
 		hyper_modify_event(efd, he, EPOLLOUT| EPOLLET);
 	}
@@ -1014,105 +1439,300 @@ out:
 static int hyper_ttyfd_read(struct hyper_event *he, int efd, int events)
 {
 	struct hyper_buf *buf = &he->rbuf;
-	uint32_t len;
+	uint32_t len, off = 0;
 	int size;
-	int ret;
 
-	if (buf->get < STREAM_HEADER_SIZE) {
-		size = hyper_channel_read(he, efd, STREAM_HEADER_SIZE - buf->get, events);
-		if (size < 0) {
-			return size;
-		}
+	size = hyper_channel_read(he, efd, events);
+	if (size <= 0)
+		return size;
+	buf->get += size;
 
-		buf->get += size;
-		if (buf->get < STREAM_HEADER_SIZE) {
-			return 0;
+	/* handle every complete frame, a partial one waits for the next read */
+	while (buf->get - off >= STREAM_HEADER_SIZE) {
+		len = hyper_get_be32(buf->data + off + STREAM_HEADER_LENGTH_OFFSET);
+		if (len < STREAM_HEADER_SIZE || len > buf->size) {
+			fprintf(stderr, "get length %" PRIu32", invalid\n", len);
+			return -1;
 		}
-	}
+		if (buf->get - off < len)
+			break;
 
-	len = hyper_get_be32(buf->data + STREAM_HEADER_LENGTH_OFFSET);
-	fprintf(stdout, "%s: get length %" PRIu32"\n", __func__, len);
-	if (len > buf->size) {
-		fprintf(stderr, "get length %" PRIu32", too long\n", len);
-		return -1;
-	}
-
-	size = hyper_channel_read(he, efd, len - buf->get, events);
-	if (size < 0) {
-		return size;
-	}
-	buf->get += size;
-	if (buf->get < len) {
-		return 0;
+		if (hyper_ttyfd_handle(he, buf->data + off, len) < 0)
+			return -1;
+		off += len;
 	}
 
-	/* get and consume the whole data */
-	ret = hyper_ttyfd_handle(he, len);
-	buf->get = 0;
+	buf->get -= off;
+	memmove(buf->data, buf->data + off, buf->get);
+	return 0;
+}
 
-	return ret == 0 ? 0 : -1;
+static int hyper_ctl_header_size(void)
+{
+	return hyper_epoll.features & FEATURE_REQUEST_ID ?
+		CONTROL_HEADER_REQID_SIZE : CONTROL_HEADER_SIZE;
 }
 
-int hyper_ctl_append_msg(struct hyper_event *he, uint32_t type, uint8_t *data, uint32_t len)
+static int hyper_ctl_send(struct hyper_event *he, uint32_t type, uint32_t id, int hdrsize,
+			  uint8_t *data, uint32_t len)
 {
+	struct hyper_buf *buf = &he->wbuf;
+	uint8_t hdr[CONTROL_HEADER_SIZE + 4];
 	int ret = -1;
-	fprintf(stdout, "hyper ctl append type %d, len %d\n", type, len);
 
-	uint8_t *new_data = realloc(data, len + 8);
-	if (new_data == NULL) {
-		new_data = data;
+	dprintf(stdout, "hyper ctl append type %d, id %" PRIu32 ", len %d\n", type, id, len);
+
+	// header and payload go straight into the wbuf ring
+	if (hyper_buf_reserve(buf, len + hdrsize) < 0)
 		goto out;
-	}
 
-	memmove(new_data + 8, new_data, len);
-	hyper_set_be32(new_data, type);
-	hyper_set_be32(new_data + 4, len + 8);
+	hyper_set_be32(hdr, type);
+	hyper_set_be32(hdr + CONTROL_HEADER_LENGTH_OFFSET, len + hdrsize);
+	if (hdrsize > CONTROL_HEADER_SIZE)
+		hyper_set_be32(hdr + CONTROL_HEADER_REQID_OFFSET, id);
+
+	hyper_buf_write(buf, buf->get, hdr, hdrsize);
+	hyper_buf_write(buf, buf->get + hdrsize, data, len);
+	buf->get += len + hdrsize;
 
-	ret = hyper_wbuf_append_msg(he, new_data, len + 8);
+	hyper_modify_event(hyper_epoll.efd, he, he->flag | EPOLLOUT);
+	ret = 0;
 out:
-	free(new_data);
+	free(data);
 	return ret;
 }
 
-static int hyper_ctlmsg_handle(struct hyper_event *he, uint32_t len)
+int hyper_ctl_append_msg(struct hyper_event *he, uint32_t type, uint8_t *data, uint32_t len)
 {
-	struct hyper_buf *buf = &he->rbuf;
-	struct hyper_pod *pod = he->ptr;
-	uint32_t type = 0, datalen = 0;
-	uint8_t *data = NULL;
-	int ret = 0;
+	return hyper_ctl_send(he, type, 0, hyper_ctl_header_size(), data, len);
+}
+
+static int hyper_ctl_send_next(uint32_t size)
+{
+	uint8_t msg[CONTROL_HEADER_REQID_SIZE + 4];
+	int hdrsize = hyper_ctl_header_size();
+
+	hyper_set_be32(msg, NEXT);
+	hyper_set_be32(msg + CONTROL_HEADER_LENGTH_OFFSET, hdrsize + 4);
+	if (hdrsize > CONTROL_HEADER_SIZE)
+		hyper_set_be32(msg + CONTROL_HEADER_REQID_OFFSET, 0);
+	hyper_set_be32(msg + hdrsize, size);
+
+	return hyper_wbuf_append_msg(&hyper_epoll.ctl, msg, hdrsize + 4);
+}
 
-	// append a null byte to it. hyper_ctlfd_read() left this room for us.
-	buf->data[buf->get] = 0;
+/* control channel, acknowledge the bytes we read */
+static int hyper_ctl_consume(uint32_t size)
+{
+	if (!(hyper_epoll.features & FEATURE_CTL_CREDIT))
+		return hyper_ctl_send_next(size);
+
+	hyper_epoll.ctl_credit += size;
+	if (hyper_epoll.ctl_credit < CONTROL_CREDIT_WINDOW / 2)
+		return 0;
+
+	size = hyper_epoll.ctl_credit;
+	hyper_epoll.ctl_credit = 0;
+	return hyper_ctl_send_next(size);
+}
+
+struct hyper_ctl_result {
+	uint32_t		type;
+	uint32_t		datalen;
+	uint8_t			*data;
+};
+
+struct hyper_ctl_batch {
+	struct hyper_ctl_request	req;
+	struct hyper_ctl_result		*results;
+	int				num;
+	int				pending;
+	int				dispatching;
+};
+
+/* the command being dispatched, see hyper_ctl_defer() */
+static struct hyper_ctl_request *hyper_ctl_current;
+
+/*
+ * called by a command handler which finishes its work later, the handler
+ * must then call hyper_ctl_complete() with the returned request exactly once.
+ */
+struct hyper_ctl_request *hyper_ctl_defer(void)
+{
+	struct hyper_ctl_request *req;
 
-	type = hyper_get_be32(buf->data);
+	if (hyper_ctl_current == NULL || hyper_ctl_current->deferred)
+		return NULL;
 
-	fprintf(stdout, "%s, type %" PRIu32 ", len %" PRIu32 "\n",
-		__func__, type, len);
+	req = malloc(sizeof(*req));
+	if (req == NULL) {
+		fprintf(stderr, "allocate deferred request failed\n");
+		return NULL;
+	}
+
+	*req = *hyper_ctl_current;
+	hyper_ctl_current->deferred = 1;
+	if (req->batch)
+		req->batch->pending++;
+
+	fprintf(stdout, "defer request %" PRIu32 ", type %" PRIu32 "\n", req->id, req->type);
+	return req;
+}
+
+static int hyper_ctl_reply(struct hyper_ctl_request *req, int ret, uint8_t *data, uint32_t datalen)
+{
+	return hyper_ctl_send(&hyper_epoll.ctl, ret < 0 ? ERROR : ACK, req->id, req->hdrsize,
+			      data, datalen);
+}
+
+static void hyper_ctl_batch_set(struct hyper_ctl_batch *batch, int index, int ret,
+				uint8_t *data, uint32_t datalen)
+{
+	struct hyper_ctl_result *result = &batch->results[index];
+
+	if (ret < 0) {
+		free(data);
+		data = NULL;
+		datalen = 0;
+	}
+
+	result->type = ret < 0 ? ERROR : ACK;
+	result->data = data;
+	result->datalen = datalen;
+}
+
+static void hyper_ctl_batch_free(struct hyper_ctl_batch *batch)
+{
+	int i;
+
+	for (i = 0; i < batch->num; i++)
+		free(batch->results[i].data);
+	free(batch->results);
+	free(batch);
+}
+
+/* pack the results of all sub-commands into one reply payload */
+static int hyper_ctl_batch_reply(struct hyper_ctl_batch *batch, uint8_t **rdata, uint32_t *rdatalen)
+{
+	uint32_t size = 0, len;
+	uint8_t *data;
+	int i;
+
+	for (i = 0; i < batch->num; i++)
+		size += CONTROL_HEADER_SIZE + batch->results[i].datalen;
+
+	data = malloc(size);
+	if (data == NULL && size > 0) {
+		perror("allocate batch result failed");
+		return -1;
+	}
+
+	size = 0;
+	for (i = 0; i < batch->num; i++) {
+		len = batch->results[i].datalen;
+		hyper_set_be32(data + size, batch->results[i].type);
+		hyper_set_be32(data + size + CONTROL_HEADER_LENGTH_OFFSET, CONTROL_HEADER_SIZE + len);
+		if (len)
+			memcpy(data + size + CONTROL_HEADER_SIZE, batch->results[i].data, len);
+		size += CONTROL_HEADER_SIZE + len;
+	}
+
+	*rdata = data;
+	*rdatalen = size;
+	return 0;
+}
+
+int hyper_ctl_complete(struct hyper_ctl_request *req, int ret, uint8_t *data, uint32_t datalen)
+{
+	struct hyper_ctl_batch *batch = req->batch;
+
+	fprintf(stdout, "complete request %" PRIu32 ", type %" PRIu32 ", ret %d\n",
+		req->id, req->type, ret);
+
+	if (batch == NULL) {
+		if (req->session == hyper_ctl_session)
+			ret = hyper_ctl_reply(req, ret, data, datalen);
+		else
+			fprintf(stdout, "ctl peer reconnected, drop the reply\n");
+		free(req);
+		return ret;
+	}
+
+	hyper_ctl_batch_set(batch, req->index, ret, data, datalen);
+	free(req);
+
+	if (--batch->pending > 0 || batch->dispatching)
+		return 0;
+
+	if (batch->req.session != hyper_ctl_session) {
+		fprintf(stdout, "ctl peer reconnected, drop the batch reply\n");
+		hyper_ctl_batch_free(batch);
+		return 0;
+	}
+
+	data = NULL;
+	datalen = 0;
+	ret = hyper_ctl_batch_reply(batch, &data, &datalen);
+	ret = hyper_ctl_reply(&batch->req, ret, data, datalen);
+	hyper_ctl_batch_free(batch);
+	return ret;
+}
+
+/*
+ * run one control command, the reply payload (if any) is returned in @data.
+ * @payload is null terminated.
+ */
+static int hyper_ctlmsg_dispatch(struct hyper_pod *pod, uint32_t type, char *payload,
+				 uint32_t len, uint8_t **data, uint32_t *datalen)
+{
+	uint8_t *pos;
+	int ret = 0;
 
 	switch (type) {
 	case GETVERSION:
-		data = malloc(4);
-		datalen = 4;
-		hyper_set_be32(data, APIVERSION);
+		*datalen = 4;
+		if (len >= 4) {
+			hyper_epoll.features = hyper_get_be32((uint8_t *)payload) & HYPER_FEATURES;
+			hyper_epoll.ctl_credit = 0;
+			fprintf(stdout, "accept features %" PRIx32 "\n", hyper_epoll.features);
+			*datalen += 4;
+			if (hyper_epoll.features & FEATURE_CTL_CREDIT)
+				*datalen += 4;
+			if (hyper_epoll.features & FEATURE_MULTI_TTY)
+				*datalen += 4;
+		}
+		*data = malloc(*datalen);
+		if (*data == NULL) {
+			*datalen = 0;
+			ret = -1;
+			break;
+		}
+		pos = *data;
+		hyper_set_be32(pos, APIVERSION);
+		pos += 4;
+		if (len < 4)
+			break;
+		hyper_set_be32(pos, hyper_epoll.features);
+		pos += 4;
+		if (hyper_epoll.features & FEATURE_CTL_CREDIT) {
+			hyper_set_be32(pos, CONTROL_CREDIT_WINDOW);
+			pos += 4;
+		}
+		if (hyper_epoll.features & FEATURE_MULTI_TTY)
+			hyper_set_be32(pos, hyper_epoll.tty_num);
 		break;
 	case STARTPOD:
-		ret = hyper_start_pod(pod, (char *)buf->data + 8, len - 8);
+		ret = hyper_start_pod(pod, payload, len);
 		hyper_print_uptime();
 		break;
-	case DESTROYPOD:
-		pod->req_destroy = 1;
-		fprintf(stdout, "get DESTROYPOD message\n");
-		hyper_destroy_pod(pod, 0);
-		return 0;
 	case EXECCMD:
-		ret = hyper_exec_cmd(pod, (char *)buf->data + 8, len - 8);
+		ret = hyper_exec_cmd(pod, payload, len);
 		break;
 	case WRITEFILE:
-		ret = hyper_cmd_rw_file(pod, (char *)buf->data + 8, len - 8, NULL, NULL, WRITEFILE);
+		ret = hyper_cmd_rw_file(pod, payload, len, NULL, NULL, WRITEFILE);
 		break;
 	case READFILE:
-		ret = hyper_cmd_rw_file(pod, (char *)buf->data + 8, len - 8, &datalen, &data, READFILE);
+		ret = hyper_cmd_rw_file(pod, payload, len, datalen, data, READFILE);
 		break;
 	case PING:
 		break;
@@ -1120,28 +1740,28 @@ static int hyper_ctlmsg_handle(struct hyper_event *he, uint32_t len)
 		ret = hyper_rescan();
 		break;
 	case WINSIZE:
-		ret = hyper_set_win_size(pod, (char *)buf->data + 8, len - 8);
+		ret = hyper_set_win_size(pod, payload, len);
 		break;
 	case NEWCONTAINER:
-		ret = hyper_new_container(pod, (char *)buf->data + 8, len - 8);
+		ret = hyper_new_container(pod, payload, len);
 		break;
 	case KILLCONTAINER:
-		ret = hyper_kill_container(pod, (char *)buf->data + 8, len - 8);
+		ret = hyper_kill_container(pod, payload, len);
 		break;
 	case REMOVECONTAINER:
-		ret = hyper_remove_container(pod, (char *)buf->data + 8, len - 8);
+		ret = hyper_remove_container(pod, payload, len);
 		break;
 	case ONLINECPUMEM:
-		hyper_cmd_online_cpu_mem();
+		ret = hyper_cmd_online_cpu_mem();
 		break;
 	case SETUPINTERFACE:
-		ret = hyper_cmd_setup_interface((char *)buf->data + 8, len - 8);
+		ret = hyper_cmd_setup_interface(payload, len);
 		break;
 	case SETUPROUTE:
-		ret = hyper_cmd_setup_route((char *)buf->data + 8, len - 8);
+		ret = hyper_cmd_setup_route(payload, len);
 		break;
 	case SIGNALPROCESS:
-		ret = hyper_signal_process(pod, (char *)buf->data + 8, len - 8);
+		ret = hyper_signal_process(pod, payload, len);
 		break;
 	case GETPOD_DEPRECATED:
 	case STOPPOD_DEPRECATED:
@@ -1156,73 +1776,221 @@ static int hyper_ctlmsg_handle(struct hyper_event *he, uint32_t len)
 		break;
 	}
 
-	return hyper_ctl_append_msg(he, ret < 0 ? ERROR: ACK, data, datalen);
+	return ret;
 }
 
-static int hyper_ctlfd_read(struct hyper_event *he, int efd, int events)
+/* check the framing of a BATCH payload, returns the number of sub-commands */
+static int hyper_ctl_batch_count(uint8_t *payload, uint32_t len)
 {
-	struct hyper_buf *buf = &he->rbuf;
-	uint32_t len;
-	int size;
-	int ret;
+	uint8_t *pos = payload, *end = payload + len;
+	uint32_t msglen;
+	int num = 0;
 
-	if (buf->get < CONTROL_HEADER_SIZE) {
-		size = hyper_channel_read(he, efd, CONTROL_HEADER_SIZE - buf->get, events);
-		if (size < 0) {
-			return size;
-		}
-		if (size > 0) {
-			uint8_t *data = malloc(4);
-			/* control channel, need ack */
-			hyper_set_be32(data, size);
-			hyper_ctl_append_msg(&hyper_epoll.ctl, NEXT, data, 4);
-		}
-		buf->get += size;
-		if (buf->get < CONTROL_HEADER_SIZE) {
-			return 0;
-		}
-	}
+	while (pos < end) {
+		if (end - pos < CONTROL_HEADER_SIZE)
+			return -1;
 
-	len = hyper_get_be32(buf->data + CONTROL_HEADER_LENGTH_OFFSET);
-	fprintf(stdout, "%s: get length %" PRIu32"\n", __func__, len);
-	// test it with '>=' to leave at least one byte in hyper_ctlfd_handle(),
-	// so that hyper_ctlfd_handle() can convert the data to c-string inplace.
-	if (len >= buf->size) {
-		uint8_t *new_data;
-		fprintf(stderr, "get length %" PRIu32", too long, extend buffer\n", len);
-		new_data = realloc(buf->data, len + 1);
-		if (!new_data) {
-			perror("realloc channel read buffer failed");
+		msglen = hyper_get_be32(pos + CONTROL_HEADER_LENGTH_OFFSET);
+		if (msglen < CONTROL_HEADER_SIZE || msglen > end - pos) {
+			fprintf(stderr, "batch sub-command length %" PRIu32 " is invalid\n", msglen);
 			return -1;
 		}
-		buf->data = new_data;
-		buf->size = len + 1;
+
+		pos += msglen;
+		num++;
 	}
 
-	size = hyper_channel_read(he, efd, len - buf->get, events);
-	if (size < 0) {
-		return size;
+	return num;
+}
+
+static int hyper_ctl_batch(struct hyper_pod *pod, uint8_t *payload, uint32_t len,
+			   uint8_t **rdata, uint32_t *rdatalen)
+{
+	struct hyper_ctl_request *parent = hyper_ctl_current;
+	struct hyper_ctl_batch *batch;
+	uint32_t type, msglen, datalen;
+	uint8_t *pos = payload, *data;
+	uint8_t save;
+	int i, num, ret;
+
+	num = hyper_ctl_batch_count(payload, len);
+	if (num < 0)
+		return -1;
+
+	batch = calloc(1, sizeof(*batch));
+	if (batch == NULL)
+		return -1;
+
+	batch->results = calloc(num, sizeof(*batch->results));
+	if (batch->results == NULL && num > 0) {
+		free(batch);
+		return -1;
 	}
-	if (size > 0) {
-		uint8_t *data = malloc(4);
-		/* control channel, need ack */
-		hyper_set_be32(data, size);
-		hyper_ctl_append_msg(&hyper_epoll.ctl, NEXT, data, 4);
+	batch->num = num;
+	batch->dispatching = 1;
+
+	for (i = 0; i < num; i++) {
+		struct hyper_ctl_request sub = {
+			.id	= parent->id,
+			.hdrsize = parent->hdrsize,
+			.session = parent->session,
+			.batch	= batch,
+			.index	= i,
+		};
+
+		type = hyper_get_be32(pos);
+		msglen = hyper_get_be32(pos + CONTROL_HEADER_LENGTH_OFFSET);
+		sub.type = type;
+
+		dprintf(stdout, "%s, type %" PRIu32 ", len %" PRIu32 "\n", __func__, type, msglen);
+
+		/*
+		 * null terminate the sub-command in place, the byte after the
+		 * last one is the room left by hyper_ctlfd_read().
+		 */
+		save = pos[msglen];
+		pos[msglen] = 0;
+		data = NULL;
+		datalen = 0;
+		hyper_ctl_current = &sub;
+		if (type == BATCH || type == DESTROYPOD)
+			ret = -1;
+		else
+			ret = hyper_ctlmsg_dispatch(pod, type, (char *)pos + CONTROL_HEADER_SIZE,
+						    msglen - CONTROL_HEADER_SIZE, &data, &datalen);
+		hyper_ctl_current = parent;
+		pos[msglen] = save;
+
+		if (sub.deferred)
+			free(data);
+		else
+			hyper_ctl_batch_set(batch, i, ret, data, datalen);
+
+		pos += msglen;
+	}
+
+	batch->dispatching = 0;
+	if (batch->pending > 0) {
+		/* the last completed sub-command sends the reply */
+		batch->req = *parent;
+		parent->deferred = 1;
+		return 0;
 	}
-	buf->get += size;
-	if (buf->get < len) {
+
+	ret = hyper_ctl_batch_reply(batch, rdata, rdatalen);
+	hyper_ctl_batch_free(batch);
+	return ret;
+}
+
+/* the payload is null terminated, the caller takes care of the byte after it */
+static int hyper_ctlmsg_handle(struct hyper_event *he, uint8_t *frame, uint32_t len)
+{
+	struct hyper_pod *pod = he->ptr;
+	struct hyper_ctl_request req = {
+		.hdrsize	= hyper_ctl_header_size(),
+		.session	= hyper_ctl_session,
+	};
+	uint32_t datalen = 0;
+	uint8_t *data = NULL, *payload;
+	int ret = 0;
+
+	req.type = hyper_get_be32(frame);
+	if (req.hdrsize > CONTROL_HEADER_SIZE)
+		req.id = hyper_get_be32(frame + CONTROL_HEADER_REQID_OFFSET);
+	payload = frame + req.hdrsize;
+	len -= req.hdrsize;
+
+	dprintf(stdout, "%s, type %" PRIu32 ", id %" PRIu32 ", len %" PRIu32 "\n",
+		__func__, req.type, req.id, len);
+
+	hyper_ctl_current = &req;
+	switch (req.type) {
+	case DESTROYPOD:
+		fprintf(stdout, "get DESTROYPOD message\n");
+		/* replied by hyper_pod_destroyed() */
+		hyper_destroy_pod_defer(pod);
+		// a retry, the teardown goes on with the grace it started with
+		if (pod->req_destroy)
+			break;
+		pod->req_destroy = 1;
+		pod->stop_grace = len >= 4 ? hyper_get_be32(payload) : DESTROYPOD_GRACE;
+		hyper_destroy_pod(pod, 0);
+		break;
+	case BATCH:
+		ret = hyper_ctl_batch(pod, payload, len, &data, &datalen);
+		break;
+	default:
+		ret = hyper_ctlmsg_dispatch(pod, req.type, (char *)payload, len, &data, &datalen);
+		break;
+	}
+	hyper_ctl_current = NULL;
+
+	if (req.deferred) {
+		free(data);
 		return 0;
 	}
 
-	/* get and consume the whole data */
-	ret = hyper_ctlmsg_handle(he, len);
-	buf->get = 0;
+	return hyper_ctl_reply(&req, ret, data, datalen);
+}
 
-	return ret == 0 ? 0 : -1;
+static int hyper_ctlfd_read(struct hyper_event *he, int efd, int events)
+{
+	struct hyper_buf *buf = &he->rbuf;
+	uint32_t len, off = 0;
+	uint8_t next;
+	int hdrsize, size, ret;
+
+	// keep one byte to null terminate the last payload in place
+	buf->size--;
+	size = hyper_channel_read(he, efd, events);
+	buf->size++;
+	if (size <= 0)
+		return size;
+
+	hyper_ctl_consume(size);
+	buf->get += size;
+
+	/* the header size may change with GETVERSION, check it for each frame */
+	while (buf->get - off >= (hdrsize = hyper_ctl_header_size())) {
+		len = hyper_get_be32(buf->data + off + CONTROL_HEADER_LENGTH_OFFSET);
+		if (len < hdrsize) {
+			fprintf(stderr, "get length %" PRIu32", too short\n", len);
+			return -1;
+		}
+		// test it with '>=' to leave at least one byte for the null
+		if (len >= buf->size) {
+			uint8_t *new_data;
+			fprintf(stderr, "get length %" PRIu32", too long, extend buffer\n", len);
+			new_data = realloc(buf->data, len + 1);
+			if (!new_data) {
+				perror("realloc channel read buffer failed");
+				return -1;
+			}
+			buf->data = new_data;
+			buf->size = len + 1;
+		}
+		if (buf->get - off < len)
+			break;
+
+		// the byte after the payload may belong to the next frame
+		next = buf->data[off + len];
+		buf->data[off + len] = 0;
+		ret = hyper_ctlmsg_handle(he, buf->data + off, len);
+		buf->data[off + len] = next;
+		if (ret < 0)
+			return -1;
+		off += len;
+	}
+
+	buf->get -= off;
+	memmove(buf->data, buf->data + off, buf->get);
+	return 0;
 }
 
 static int hyper_channel_write(struct hyper_event *he, int efd, int events)
 {
+	struct hyper_tty *tty = NULL;
+
 	// virtio serial port receives writable event, it means peer appears
 	if (he->hup){
 		he->hup = 0;
@@ -1230,7 +1998,21 @@ static int hyper_channel_write(struct hyper_event *he, int efd, int events)
 		hyper_modify_event(efd, he, EPOLLIN| EPOLLOUT);
 	}
 
-	return hyper_event_write(he, efd, events);
+	if (he != &hyper_epoll.ctl)
+		tty = container_of(he, struct hyper_tty, ev);
+
+	// the spliced frame must be finished before the buffered data
+	if (tty && hyper_splice_continue(tty) > 0)
+		return 0;
+
+	if (hyper_event_write(he, efd, events) < 0)
+		return -1;
+
+	// room in the tty buffer, let the queued output streams in
+	if (tty)
+		hyper_stream_schedule(tty);
+
+	return 0;
 }
 
 static struct hyper_event_ops hyper_ctlfd_ops = {
@@ -1260,9 +2042,8 @@ static int hyper_loop(void)
 	sigaddset(&mask, SIGCHLD);
 
 	/*
-	 * block SIGCHLD in the loop except when in the syscall of
-	 * epoll_pwait(), it ensures that the SIGCHLD handling and
-	 * the events handling are exclusive.
+	 * block SIGCHLD for good, child exits are read from a signalfd in
+	 * the loop so they are handled like any other event.
 	 */
 	if (sigprocmask(SIG_BLOCK, &mask, &omask) < 0) {
 		perror("sigprocmask SIGCHLD failed");
@@ -1270,8 +2051,6 @@ static int hyper_loop(void)
 	}
 	// need original mask to restore sigmask of child processes
 	orig_mask = omask;
-	sigdelset(&omask, SIGCHLD);
-	signal(SIGCHLD, hyper_init_sigchld);
 	prctl(PR_SET_CHILD_SUBREAPER, 1);
 
 	if (hyper_write_file("/proc/sys/fs/file-max", filemax, strlen(filemax)) < 0) {
@@ -1299,7 +2078,7 @@ static int hyper_loop(void)
 		return -1;
 	}
 
-	hyper_epoll.efd = epoll_create1(EPOLL_CLOEXEC);
+	hyper_epoll.efd = hyper_create_events();
 	if (hyper_epoll.efd < 0) {
 		perror("epoll_create failed");
 		return -1;
@@ -1312,17 +2091,39 @@ static int hyper_loop(void)
 		return -1;
 	}
 
-	fprintf(stdout, "hyper_init_event hyper ttyfd event %p, ops %p, fd %d\n",
-		&hyper_epoll.tty, &hyper_ttyfd_ops, hyper_epoll.tty.fd);
-	if (hyper_init_event(&hyper_epoll.tty, &hyper_ttyfd_ops, pod) < 0 ||
-	    hyper_add_event(hyper_epoll.efd, &hyper_epoll.tty, EPOLLIN) < 0) {
+	for (i = 0; i < hyper_epoll.tty_num; i++) {
+		struct hyper_tty *tty = &hyper_epoll.tty[i];
+
+		fprintf(stdout, "hyper_init_event hyper ttyfd event %p, ops %p, fd %d\n",
+			&tty->ev, &hyper_ttyfd_ops, tty->ev.fd);
+		INIT_LIST_HEAD(&tty->streams);
+		if (hyper_init_event(&tty->ev, &hyper_ttyfd_ops, pod) < 0 ||
+		    hyper_add_event(hyper_epoll.efd, &tty->ev, EPOLLIN) < 0) {
+			return -1;
+		}
+	}
+
+	if (hyper_timer_setup(hyper_epoll.efd) < 0)
+		return -1;
+
+	hyper_epoll.sigchld.fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (hyper_epoll.sigchld.fd < 0) {
+		perror("create signalfd for SIGCHLD failed");
+		return -1;
+	}
+
+	if (hyper_init_event(&hyper_epoll.sigchld, &hyper_sigchld_ops, pod) < 0 ||
+	    hyper_add_event(hyper_epoll.efd, &hyper_epoll.sigchld, EPOLLIN) < 0) {
 		return -1;
 	}
 
+	// children exited before the signalfd existed
+	hyper_handle_exit(pod);
+
 	events = calloc(MAXEVENTS, sizeof(*events));
 
 	while (1) {
-		n = epoll_pwait(hyper_epoll.efd, events, MAXEVENTS, -1, &omask);
+		n = hyper_wait_event(hyper_epoll.efd, events, MAXEVENTS);
 		if (n < 0) {
 			if (errno == EINTR)
 				continue;
@@ -1343,7 +2144,8 @@ static int hyper_loop(void)
 
 int main(int argc, char *argv[])
 {
-	char *cmdline, *ctl_serial, *tty_serial;
+	char *cmdline;
+	int i;
 
 	if (mount("proc", "/proc", "proc", MS_NOSUID| MS_NODEV| MS_NOEXEC, NULL) == -1) {
 		perror("mount proc failed");
@@ -1388,36 +2190,37 @@ int main(int argc, char *argv[])
 	ioctl(STDIN_FILENO, TIOCSCTTY, 1);
 
 #ifdef WITH_VBOX
-	ctl_serial = "/dev/ttyS0";
-	tty_serial = "/dev/ttyS1";
-
 	if (hyper_insmod("/vboxguest.ko") < 0 ||
 	    hyper_insmod("/vboxsf.ko") < 0) {
 		fprintf(stderr, "fail to load modules\n");
 		return -1;
 	}
-#else
-	ctl_serial = "sh.hyper.channel.0";
-	tty_serial = "sh.hyper.channel.1";
 #endif
 
 	setenv("PATH", "/bin:/sbin/:/usr/bin/:/usr/sbin/", 1);
 
-	hyper_epoll.ctl.fd = hyper_setup_ctl_channel(ctl_serial);
+	hyper_event_backend_init(cmdline);
+
+	if (hyper_transport_init(cmdline) < 0) {
+		fprintf(stderr, "fail to setup channel transport\n");
+		goto out1;
+	}
+
+	hyper_epoll.ctl.fd = hyper_setup_ctl_channel();
 	if (hyper_epoll.ctl.fd < 0) {
 		fprintf(stderr, "fail to setup hyper control serial port\n");
 		goto out1;
 	}
 
-	hyper_epoll.tty.fd = hyper_setup_tty_channel(tty_serial);
-	if (hyper_epoll.tty.fd < 0) {
+	if (hyper_setup_tty_channel() < 0) {
 		fprintf(stderr, "fail to setup hyper tty serial port\n");
 		goto out2;
 	}
 
 	hyper_loop();
 
-	close(hyper_epoll.tty.fd);
+	for (i = 0; i < hyper_epoll.tty_num; i++)
+		close(hyper_epoll.tty[i].ev.fd);
 out2:
 	close(hyper_epoll.ctl.fd);
 out1:
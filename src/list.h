@@ -188,4 +188,68 @@ static inline int list_empty(const struct list_head *head)
 	     n = list_next_entry(pos, member);				\
 	     &pos->member != (head); 					\
 	     pos = n, n = list_next_entry(n, member))
+
+/*
+ * Double linked lists with a single pointer list head, for hash tables
+ * where the two pointer head would be too wasteful. An all zero
+ * hlist_head or hlist_node is empty or unhashed.
+ */
+
+struct hlist_head {
+	struct hlist_node *first;
+};
+
+struct hlist_node {
+	struct hlist_node *next, **pprev;
+};
+
+static inline int hlist_unhashed(const struct hlist_node *h)
+{
+	return !h->pprev;
+}
+
+static inline void hlist_add_head(struct hlist_node *n, struct hlist_head *h)
+{
+	struct hlist_node *first = h->first;
+
+	n->next = first;
+	if (first)
+		first->pprev = &n->next;
+	h->first = n;
+	n->pprev = &h->first;
+}
+
+/**
+ * hlist_del_init - deletes entry from its hash list and reinitialize it.
+ * @n: the element to delete, nothing happens if it is unhashed.
+ */
+static inline void hlist_del_init(struct hlist_node *n)
+{
+	if (hlist_unhashed(n))
+		return;
+
+	*n->pprev = n->next;
+	if (n->next)
+		n->next->pprev = n->pprev;
+	n->next = NULL;
+	n->pprev = NULL;
+}
+
+#define hlist_entry(ptr, type, member) container_of(ptr, type, member)
+
+#define hlist_entry_safe(ptr, type, member) \
+	({ typeof(ptr) ____ptr = (ptr); \
+	   ____ptr ? hlist_entry(____ptr, type, member) : NULL; \
+	})
+
+/**
+ * hlist_for_each_entry	- iterate over hash list of given type
+ * @pos:	the type * to use as a loop cursor.
+ * @head:	the head for your hash list.
+ * @member:	the name of the hlist_node within the struct.
+ */
+#define hlist_for_each_entry(pos, head, member)				\
+	for (pos = hlist_entry_safe((head)->first, typeof(*(pos)), member);\
+	     pos;							\
+	     pos = hlist_entry_safe((pos)->member.next, typeof(*(pos)), member))
 #endif
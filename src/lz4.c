@@ -0,0 +1,125 @@
+#include <string.h>
+
+#include "lz4.h"
+
+/*
+ * A small greedy compressor producing the LZ4 block format, any LZ4
+ * decoder (e.g. LZ4_decompress_safe) reads its output.
+ */
+
+#define LZ4_MINMATCH		4
+#define LZ4_LASTLITERALS	5
+#define LZ4_MFLIMIT		12
+#define LZ4_MAX_OFFSET		65535
+#define LZ4_HASH_LOG		12
+
+static uint32_t lz4_read32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint32_t lz4_hash(uint32_t v)
+{
+	return (v * 2654435761U) >> (32 - LZ4_HASH_LOG);
+}
+
+static uint8_t *lz4_put_length(uint8_t *op, uint32_t len)
+{
+	while (len >= 255) {
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = len;
+	return op;
+}
+
+static uint8_t *lz4_put_literals(uint8_t *op, uint8_t *oend, uint8_t *token,
+				 const uint8_t *lit, uint32_t len)
+{
+	if (op + len + len / 255 + 1 > oend)
+		return NULL;
+
+	if (len >= 15) {
+		*token = 15 << 4;
+		op = lz4_put_length(op, len - 15);
+	} else {
+		*token = len << 4;
+	}
+
+	memcpy(op, lit, len);
+	return op + len;
+}
+
+/*
+ * compress srclen bytes of src into dst, returns the compressed size or
+ * 0 if it doesn't fit into dstlen bytes.
+ */
+int hyper_lz4_compress(const uint8_t *src, int srclen, uint8_t *dst, int dstlen)
+{
+	uint16_t table[1 << LZ4_HASH_LOG];
+	const uint8_t *ip = src, *anchor = src, *ref, *end = src + srclen;
+	const uint8_t *mflimit = src, *matchlimit = src;
+	uint8_t *op = dst, *oend = dst + dstlen, *token;
+	uint32_t h, len;
+
+	if (srclen > LZ4_MAX_OFFSET)
+		return 0;
+
+	memset(table, 0, sizeof(table));
+	if (srclen > LZ4_MFLIMIT) {
+		mflimit = end - LZ4_MFLIMIT;
+		matchlimit = end - LZ4_LASTLITERALS;
+	}
+
+	while (ip < mflimit) {
+		h = lz4_hash(lz4_read32(ip));
+		ref = src + table[h];
+		table[h] = ip - src;
+
+		if (ref >= ip || lz4_read32(ref) != lz4_read32(ip)) {
+			ip++;
+			continue;
+		}
+
+		while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+			ip--;
+			ref--;
+		}
+
+		len = LZ4_MINMATCH;
+		while (ip + len < matchlimit && ip[len] == ref[len])
+			len++;
+
+		token = op++;
+		op = lz4_put_literals(op, oend, token, anchor, ip - anchor);
+		if (op == NULL || op + 2 + (len - LZ4_MINMATCH) / 255 + 1 > oend)
+			return 0;
+
+		*op++ = (ip - ref) & 0xff;
+		*op++ = (ip - ref) >> 8;
+
+		len -= LZ4_MINMATCH;
+		if (len >= 15) {
+			*token |= 15;
+			op = lz4_put_length(op, len - 15);
+		} else {
+			*token |= len;
+		}
+
+		ip += len + LZ4_MINMATCH;
+		anchor = ip;
+	}
+
+	if (op >= oend)
+		return 0;
+
+	token = op++;
+	op = lz4_put_literals(op, oend, token, anchor, end - anchor);
+	if (op == NULL)
+		return 0;
+
+	return op - dst;
+}
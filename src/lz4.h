@@ -0,0 +1,11 @@
+#ifndef _LZ4_H
+#define _LZ4_H
+
+#include <inttypes.h>
+
+/* worst case size of a compressed block */
+#define LZ4_COMPRESS_BOUND(size)	((size) + (size) / 255 + 16)
+
+int hyper_lz4_compress(const uint8_t *src, int srclen, uint8_t *dst, int dstlen);
+
+#endif
@@ -6,6 +6,7 @@
 #include "list.h"
 #include "parse.h"
 #include "util.h"
+#include "pool.h"
 
 /* parse_utf_16() and process_string() are copied from https://github.com/kgabis/parson */
 #include <ctype.h>
@@ -226,6 +227,9 @@ void hyper_cleanup_exec(struct hyper_exec *exec)
 	free(exec->workdir);
 	exec->workdir = NULL;
 
+	free(exec->datachannel);
+	exec->datachannel = NULL;
+
 	for (i = 0; i < exec->envs_num; i++) {
 		free(exec->envs[i].env);
 		free(exec->envs[i].value);
@@ -536,6 +540,28 @@ static int hyper_parse_process(struct hyper_exec *exec, char *json, jsmntok_t *t
 			exec->workdir = (json_token_str(json, &toks[++i]));
 			dprintf(stdout, "container workdir %s\n", exec->workdir);
 			i++;
+		} else if (json_token_streq(json, t, "datachannel") && t->size == 1) {
+			exec->datachannel = (json_token_str(json, &toks[++i]));
+			dprintf(stdout, "container process data channel %s\n", exec->datachannel);
+			i++;
+		} else if (json_token_streq(json, t, "weight") && t->size == 1) {
+			exec->weight = json_token_int(json, &toks[++i]);
+			dprintf(stdout, "container process weight %d\n", exec->weight);
+			i++;
+		} else if (json_token_streq(json, t, "coalesce") && t->size == 1) {
+			t = &toks[++i];
+			if (json_token_streq(json, t, "none"))
+				exec->coalesce = STREAM_COALESCE_NONE;
+			else if (json_token_streq(json, t, "latency"))
+				exec->coalesce = STREAM_COALESCE_LATENCY;
+			else if (json_token_streq(json, t, "throughput"))
+				exec->coalesce = STREAM_COALESCE_THROUGHPUT;
+			dprintf(stdout, "container process coalesce %d\n", exec->coalesce);
+			i++;
+		} else if (json_token_streq(json, t, "timeout") && t->size == 1) {
+			exec->timeout = json_token_int(json, &toks[++i]);
+			dprintf(stdout, "container process timeout %" PRIu32 "\n", exec->timeout);
+			i++;
 		}
 	}
 
@@ -630,6 +656,7 @@ void hyper_free_container(struct hyper_container *c)
 	hyper_cleanup_exec(&c->exec);
 
 	list_del_init(&c->list);
+	hlist_del_init(&c->hnode);
 	free(c);
 }
 
@@ -656,6 +683,9 @@ static int hyper_parse_container(struct hyper_pod *pod, struct hyper_container *
 	c->exec.stdinev.fd = -1;
 	c->exec.stdoutev.fd = -1;
 	c->exec.stderrev.fd = -1;
+	c->exec.pidev.fd = -1;
+	c->exec.sigfd = -1;
+	c->exec.datafd = -1;
 	c->exec.ptyfd = -1;
 	c->ns = -1;
 	INIT_LIST_HEAD(&c->list);
@@ -716,6 +746,12 @@ static int hyper_parse_container(struct hyper_pod *pod, struct hyper_container *
 				dprintf(stdout, "need to initialize container\n");
 			}
 			i++;
+		} else if (json_token_streq(json, t, "zygote") && t->size == 1) {
+			if (!json_token_streq(json, &toks[++i], "false")) {
+				c->use_zygote = 1;
+				dprintf(stdout, "spawn container processes from a zygote\n");
+			}
+			i++;
 		} else if (json_token_streq(json, t, "ports") && t->size == 1) {
 			next = container_parse_ports(c, json, &toks[++i]);
 			if (next < 0)
@@ -755,7 +791,7 @@ static int hyper_parse_containers(struct hyper_pod *pod, char *json, jsmntok_t *
 			goto fail;
 
 		/* Pod created containers, Add to list immediately */
-		list_add_tail(&c->list, &pod->containers);
+		hyper_add_container(pod, c);
 		i += next;
 	}
 
@@ -1331,6 +1367,36 @@ fail:
 	return NULL;
 }
 
+/* execs come and go with every EXECCMD, keep some around */
+static struct hyper_pool hyper_exec_pool = HYPER_POOL(sizeof(struct hyper_exec), 32);
+
+static struct hyper_exec *hyper_new_exec(void)
+{
+	struct hyper_exec *exec = hyper_pool_zalloc(&hyper_exec_pool);
+
+	if (exec == NULL) {
+		dprintf(stderr, "allocate memory for exec cmd failed\n");
+		return NULL;
+	}
+
+	exec->ptyfd = -1;
+	exec->stdinev.fd = -1;
+	exec->stdoutev.fd = -1;
+	exec->stderrev.fd = -1;
+	exec->pidev.fd = -1;
+	exec->sigfd = -1;
+	exec->datafd = -1;
+	INIT_LIST_HEAD(&exec->list);
+
+	return exec;
+}
+
+void hyper_free_exec(struct hyper_exec *exec)
+{
+	hyper_cleanup_exec(exec);
+	hyper_pool_free(&hyper_exec_pool, exec);
+}
+
 struct hyper_exec *hyper_parse_execcmd(char *json, int length)
 {
 	int i, j, n;
@@ -1358,17 +1424,9 @@ realloc:
 		goto out;
 	}
 
-	exec = calloc(1, sizeof(*exec));
-	if (exec == NULL) {
-		dprintf(stderr, "allocate memory for exec cmd failed\n");
+	exec = hyper_new_exec();
+	if (exec == NULL)
 		goto out;
-	}
-
-	exec->ptyfd = -1;
-	exec->stdinev.fd = -1;
-	exec->stdoutev.fd = -1;
-	exec->stderrev.fd = -1;
-	INIT_LIST_HEAD(&exec->list);
 
 	for (i = 0; i < n; i++) {
 		jsmntok_t *t = &toks[i];
@@ -1394,16 +1452,273 @@ realloc:
 		goto fail;
 	}
 
+	if (exec->argc == 0) {
+		dprintf(stderr, "execcmd format error, has no args\n");
+		goto fail;
+	}
+
 out:
 	free(toks);
 	return exec;
 fail:
-	hyper_cleanup_exec(exec);
-	free(exec);
+	hyper_free_exec(exec);
 	exec = NULL;
 	goto out;
 }
 
+/* returns 1 when a field is decoded, 0 at the end of data, -1 if malformed */
+int hyper_tlv_next(uint8_t **pos, uint8_t *end, struct hyper_tlv *tlv)
+{
+	uint8_t *p = *pos;
+
+	if (p == end)
+		return 0;
+
+	if (end - p < TLV_HEADER_SIZE) {
+		dprintf(stderr, "truncated tlv header\n");
+		return -1;
+	}
+
+	tlv->tag = p[0];
+	tlv->len = hyper_get_be32(p + TLV_LENGTH_OFFSET);
+	if (tlv->len > end - p - TLV_HEADER_SIZE) {
+		dprintf(stderr, "tlv %d length %" PRIu32 " is out of range\n", tlv->tag, tlv->len);
+		return -1;
+	}
+
+	tlv->value = p + TLV_HEADER_SIZE;
+	*pos = tlv->value + tlv->len;
+	return 1;
+}
+
+// the string stays in the message buffer, don't free it
+static char *hyper_tlv_str(struct hyper_tlv *tlv)
+{
+	if (tlv->len == 0 || tlv->value[tlv->len - 1] != '\0') {
+		dprintf(stderr, "tlv %d is not a string\n", tlv->tag);
+		return NULL;
+	}
+
+	return (char *)tlv->value;
+}
+
+static int hyper_tlv_strdup(struct hyper_tlv *tlv, char **str)
+{
+	char *s = hyper_tlv_str(tlv);
+
+	if (s == NULL)
+		return -1;
+
+	free(*str);
+	*str = strdup(s);
+	return *str == NULL ? -1 : 0;
+}
+
+static int hyper_tlv_u32(struct hyper_tlv *tlv, uint32_t *val)
+{
+	if (tlv->len != 4) {
+		dprintf(stderr, "tlv %d is not u32\n", tlv->tag);
+		return -1;
+	}
+
+	*val = hyper_get_be32(tlv->value);
+	return 0;
+}
+
+static int hyper_tlv_u64(struct hyper_tlv *tlv, uint64_t *val)
+{
+	if (tlv->len != 8) {
+		dprintf(stderr, "tlv %d is not u64\n", tlv->tag);
+		return -1;
+	}
+
+	*val = hyper_get_be64(tlv->value);
+	return 0;
+}
+
+static int hyper_parse_env_tlv(struct env *env, struct hyper_tlv *tlv)
+{
+	char *s = hyper_tlv_str(tlv);
+	char *eq;
+
+	if (s == NULL || (eq = strchr(s, '=')) == NULL) {
+		dprintf(stderr, "env tlv need KEY=VALUE\n");
+		return -1;
+	}
+
+	env->env = strndup(s, eq - s);
+	env->value = strdup(eq + 1);
+	if (env->env == NULL || env->value == NULL)
+		return -1;
+
+	dprintf(stdout, "exec env %s:%s\n", env->env, env->value);
+	return 0;
+}
+
+struct hyper_exec *hyper_parse_execcmd_tlv(uint8_t *data, int length)
+{
+	uint8_t *pos, *end = data + length;
+	struct hyper_exec *exec;
+	struct hyper_tlv tlv;
+	int argc = 0, envs = 0, groups = 0;
+	uint32_t tty = 0, weight = 0, coalesce = 0;
+	int ret;
+
+	exec = hyper_new_exec();
+	if (exec == NULL)
+		return NULL;
+
+	/* count the repeatable fields first, then the arrays are allocated once */
+	pos = data;
+	while ((ret = hyper_tlv_next(&pos, end, &tlv)) > 0) {
+		if (tlv.tag == TLV_ARG)
+			argc++;
+		else if (tlv.tag == TLV_ENV)
+			envs++;
+		else if (tlv.tag == TLV_ADDITIONAL_GROUP)
+			groups++;
+	}
+	if (ret < 0)
+		goto fail;
+
+	exec->argv = calloc(argc + 1, sizeof(*exec->argv));
+	exec->envs = calloc(envs, sizeof(*exec->envs));
+	exec->additional_groups = calloc(groups, sizeof(*exec->additional_groups));
+	if (exec->argv == NULL || (envs && exec->envs == NULL) ||
+	    (groups && exec->additional_groups == NULL)) {
+		dprintf(stderr, "allocate memory for exec arrays failed\n");
+		goto fail;
+	}
+
+	pos = data;
+	while (hyper_tlv_next(&pos, end, &tlv) > 0) {
+		switch (tlv.tag) {
+		case TLV_CONTAINER:
+			ret = hyper_tlv_strdup(&tlv, &exec->container_id);
+			break;
+		case TLV_PROCESS:
+			ret = hyper_tlv_strdup(&tlv, &exec->id);
+			break;
+		case TLV_USER:
+			ret = hyper_tlv_strdup(&tlv, &exec->user);
+			break;
+		case TLV_GROUP:
+			ret = hyper_tlv_strdup(&tlv, &exec->group);
+			break;
+		case TLV_WORKDIR:
+			ret = hyper_tlv_strdup(&tlv, &exec->workdir);
+			break;
+		case TLV_TERMINAL:
+			ret = hyper_tlv_u32(&tlv, &tty);
+			exec->tty = tty != 0;
+			break;
+		case TLV_DATACHANNEL:
+			ret = hyper_tlv_strdup(&tlv, &exec->datachannel);
+			break;
+		case TLV_WEIGHT:
+			ret = hyper_tlv_u32(&tlv, &weight);
+			exec->weight = weight;
+			break;
+		case TLV_TIMEOUT:
+			ret = hyper_tlv_u32(&tlv, &exec->timeout);
+			break;
+		case TLV_COALESCE:
+			ret = hyper_tlv_u32(&tlv, &coalesce);
+			exec->coalesce = coalesce < STREAM_COALESCE_MAX ? coalesce : 0;
+			break;
+		case TLV_STDIO:
+			ret = hyper_tlv_u64(&tlv, &exec->seq);
+			break;
+		case TLV_STDERR:
+			ret = hyper_tlv_u64(&tlv, &exec->errseq);
+			break;
+		case TLV_ARG:
+			ret = hyper_tlv_strdup(&tlv, &exec->argv[exec->argc]);
+			if (ret == 0)
+				exec->argc++;
+			break;
+		case TLV_ADDITIONAL_GROUP:
+			ret = hyper_tlv_strdup(&tlv, &exec->additional_groups[exec->nr_additional_groups]);
+			if (ret == 0)
+				exec->nr_additional_groups++;
+			break;
+		case TLV_ENV:
+			// count it first, cleanup frees the partially parsed one
+			ret = hyper_parse_env_tlv(&exec->envs[exec->envs_num++], &tlv);
+			break;
+		default:
+			dprintf(stdout, "skip unknown exec tlv %d\n", tlv.tag);
+			ret = 0;
+			break;
+		}
+
+		if (ret < 0)
+			goto fail;
+	}
+
+	if (exec->container_id == NULL || strlen(exec->container_id) == 0) {
+		dprintf(stderr, "execcmd format error, has no container id\n");
+		goto fail;
+	}
+
+	if (exec->seq == 0) {
+		dprintf(stderr, "execcmd format error, has no seq\n");
+		goto fail;
+	}
+
+	if (exec->argc == 0) {
+		dprintf(stderr, "execcmd format error, has no args\n");
+		goto fail;
+	}
+
+	return exec;
+fail:
+	hyper_free_exec(exec);
+	return NULL;
+}
+
+int hyper_parse_process_cmd_tlv(struct hyper_process_cmd *cmd, uint8_t *data, int length)
+{
+	uint8_t *pos = data, *end = data + length;
+	struct hyper_tlv tlv;
+	uint32_t val = 0;
+	int ret;
+
+	memset(cmd, 0, sizeof(*cmd));
+
+	while ((ret = hyper_tlv_next(&pos, end, &tlv)) > 0) {
+		switch (tlv.tag) {
+		case TLV_CONTAINER:
+			cmd->container = hyper_tlv_str(&tlv);
+			if (cmd->container == NULL)
+				return -1;
+			break;
+		case TLV_PROCESS:
+			cmd->process = hyper_tlv_str(&tlv);
+			if (cmd->process == NULL)
+				return -1;
+			break;
+		case TLV_SIGNAL:
+		case TLV_ROW:
+		case TLV_COLUMN:
+			if (hyper_tlv_u32(&tlv, &val) < 0)
+				return -1;
+			if (tlv.tag == TLV_SIGNAL)
+				cmd->signal = val;
+			else if (tlv.tag == TLV_ROW)
+				cmd->row = val;
+			else
+				cmd->column = val;
+			break;
+		default:
+			dprintf(stdout, "skip unknown process cmd tlv %d\n", tlv.tag);
+			break;
+		}
+	}
+
+	return ret;
+}
+
 int hyper_parse_file_command(struct file_command *cmd, char *json, int length)
 {
 	int i, n, ret = -1;
@@ -17,5 +17,16 @@ struct hyper_interface *hyper_parse_setup_interface(char *json, int length);
 void hyper_free_interface(struct hyper_interface *iface);
 int hyper_parse_setup_routes(struct hyper_route **routes, uint32_t *r_num, char *json, int length);
 JSON_Value *hyper_json_parse(char *json, int length);
+
+struct hyper_tlv {
+	uint8_t		tag;
+	uint32_t	len;
+	uint8_t		*value;
+};
+
+int hyper_tlv_next(uint8_t **pos, uint8_t *end, struct hyper_tlv *tlv);
+struct hyper_exec *hyper_parse_execcmd_tlv(uint8_t *data, int length);
+int hyper_parse_process_cmd_tlv(struct hyper_process_cmd *cmd, uint8_t *data, int length);
 void hyper_cleanup_exec(struct hyper_exec *exec);
+void hyper_free_exec(struct hyper_exec *exec);
 #endif
@@ -0,0 +1,85 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+
+/*
+ * The objects of a pool are plain heap chunks, a free one links the next
+ * through its first word. Buffers taken from a pool may still be grown
+ * with realloc and released with free.
+ */
+
+/* the buffer sizes of the hyper_event_ops, other sizes are not pooled */
+static struct hyper_pool hyper_buf_pools[] = {
+	HYPER_POOL(512, 64),	// exec stdin
+	HYPER_POOL(4096, 8),	// ctl wbuf, tty rbuf
+	HYPER_POOL(10240, 8),	// ctl rbuf, tty wbuf
+};
+
+#define HYPER_BUF_POOLS	(sizeof(hyper_buf_pools) / sizeof(hyper_buf_pools[0]))
+
+void *hyper_pool_alloc(struct hyper_pool *pool)
+{
+	void *obj = pool->free;
+
+	if (obj == NULL)
+		return malloc(pool->size);
+
+	pool->free = *(void **)obj;
+	pool->num--;
+	return obj;
+}
+
+void *hyper_pool_zalloc(struct hyper_pool *pool)
+{
+	void *obj = hyper_pool_alloc(pool);
+
+	if (obj != NULL)
+		memset(obj, 0, pool->size);
+	return obj;
+}
+
+void hyper_pool_free(struct hyper_pool *pool, void *obj)
+{
+	if (obj == NULL)
+		return;
+
+	if (pool->num >= pool->max) {
+		free(obj);
+		return;
+	}
+
+	*(void **)obj = pool->free;
+	pool->free = obj;
+	pool->num++;
+}
+
+static struct hyper_pool *hyper_buf_pool(uint32_t size)
+{
+	int i;
+
+	for (i = 0; i < HYPER_BUF_POOLS; i++) {
+		if (hyper_buf_pools[i].size == size)
+			return &hyper_buf_pools[i];
+	}
+
+	return NULL;
+}
+
+void *hyper_buf_alloc(uint32_t size)
+{
+	struct hyper_pool *pool = hyper_buf_pool(size);
+
+	return pool ? hyper_pool_alloc(pool) : malloc(size);
+}
+
+/* size must be the size the buffer was allocated or reallocated with */
+void hyper_buf_free(void *data, uint32_t size)
+{
+	struct hyper_pool *pool = hyper_buf_pool(size);
+
+	if (pool != NULL)
+		hyper_pool_free(pool, data);
+	else
+		free(data);
+}
@@ -0,0 +1,26 @@
+#ifndef _POOL_H
+#define _POOL_H
+
+#include <inttypes.h>
+
+/*
+ * a free list of fixed size objects, released objects are kept for the
+ * next allocation instead of going back to the heap.
+ */
+struct hyper_pool {
+	uint32_t	size;
+	int		max;	// free objects kept at most
+	int		num;
+	void		*free;
+};
+
+#define HYPER_POOL(_size, _max)	{ .size = (_size), .max = (_max) }
+
+void *hyper_pool_alloc(struct hyper_pool *pool);
+void *hyper_pool_zalloc(struct hyper_pool *pool);
+void hyper_pool_free(struct hyper_pool *pool, void *obj);
+
+void *hyper_buf_alloc(uint32_t size);
+void hyper_buf_free(void *data, uint32_t size);
+
+#endif
@@ -1,5 +1,6 @@
 #define _GNU_SOURCE
 #include <unistd.h>
+#include <errno.h>
 #include <sys/syscall.h>
 
 /*
@@ -14,3 +15,56 @@ static inline int setns(int fd, int nstype)
 	return errno == 0 ? 0 : -1;
 }
 #endif
+
+/*
+ * pidfd syscalls, glibc has no wrappers for them. Without the syscall
+ * numbers they fail with ENOSYS and the callers fall back to plain pids.
+ */
+#define HYPER_P_PIDFD	3	/* idtype of waitid(), P_PIDFD */
+
+static inline int hyper_pidfd_open(int pid)
+{
+#ifdef __NR_pidfd_open
+	return syscall(__NR_pidfd_open, pid, 0);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+static inline int hyper_pidfd_send_signal(int pidfd, int sig)
+{
+#ifdef __NR_pidfd_send_signal
+	return syscall(__NR_pidfd_send_signal, pidfd, sig, NULL, 0);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+/*
+ * io_uring syscalls, used by the io_uring event backend. They fail with
+ * ENOSYS without the syscall numbers and the loop stays on epoll.
+ */
+struct io_uring_params;
+
+static inline int hyper_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+#ifdef __NR_io_uring_setup
+	return syscall(__NR_io_uring_setup, entries, p);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+static inline int hyper_io_uring_enter(int fd, unsigned submit, unsigned complete,
+				       unsigned flags)
+{
+#ifdef __NR_io_uring_enter
+	return syscall(__NR_io_uring_enter, fd, submit, complete, flags, NULL, 0);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
@@ -0,0 +1,168 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/timerfd.h>
+
+#include "hyper.h"
+#include "timer.h"
+
+/*
+ * A hashed wheel of one millisecond slots driven by a timerfd in the main
+ * loop. A timer more than a turn away sits in its slot until the wheel
+ * comes around at its expire time. The timerfd is armed for the first
+ * slot holding a timer.
+ */
+#define TIMER_WHEEL_SIZE	1024
+
+static struct list_head timer_wheel[TIMER_WHEEL_SIZE];
+/* the last tick handled, the tick the timerfd is armed for */
+static uint64_t timer_clock, timer_armed;
+static int timer_num;
+
+uint64_t hyper_timer_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+int hyper_timer_pending(struct hyper_timer *t)
+{
+	return t->list.next != NULL && !list_empty(&t->list);
+}
+
+static void hyper_timer_arm(uint64_t tick)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = tick / 1000;
+	its.it_value.tv_nsec = (tick % 1000) * 1000000;
+
+	if (timerfd_settime(hyper_epoll.timer.fd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+		perror("arm timerfd failed");
+		return;
+	}
+	timer_armed = tick;
+}
+
+/* arm the timerfd for the next slot in use, disarm it if there is none */
+static void hyper_timer_rearm(void)
+{
+	uint64_t tick;
+
+	if (timer_num == 0) {
+		if (timer_armed)
+			hyper_timer_arm(0);
+		return;
+	}
+
+	for (tick = timer_clock + 1; tick <= timer_clock + TIMER_WHEEL_SIZE; tick++) {
+		if (!list_empty(&timer_wheel[tick % TIMER_WHEEL_SIZE]))
+			break;
+	}
+
+	hyper_timer_arm(tick);
+}
+
+void hyper_timer_add(struct hyper_timer *t, uint32_t msec, void (*fn)(struct hyper_timer *t))
+{
+	uint64_t now = hyper_timer_now(), tick;
+
+	hyper_timer_del(t);
+
+	// the wheel stood still while idle
+	if (timer_num == 0)
+		timer_clock = now;
+
+	t->fn = fn;
+	t->expire = now + msec;
+	tick = t->expire > timer_clock ? t->expire : timer_clock + 1;
+	list_add_tail(&t->list, &timer_wheel[tick % TIMER_WHEEL_SIZE]);
+	timer_num++;
+
+	if (timer_armed == 0 || tick < timer_armed)
+		hyper_timer_arm(tick);
+}
+
+void hyper_timer_del(struct hyper_timer *t)
+{
+	if (!hyper_timer_pending(t))
+		return;
+
+	list_del_init(&t->list);
+	timer_num--;
+}
+
+static int hyper_timer_read(struct hyper_event *he, int efd, int events)
+{
+	struct hyper_timer *t, *n;
+	LIST_HEAD(expired);
+	uint64_t now, ticks, exp;
+	int i;
+
+	if (read(he->fd, &exp, sizeof(exp)) < 0 && errno != EAGAIN) {
+		perror("read timerfd failed");
+		return -1;
+	}
+
+	now = hyper_timer_now();
+	timer_armed = 0;
+
+	// visit each slot once at most however late we are
+	ticks = now - timer_clock;
+	if (ticks > TIMER_WHEEL_SIZE)
+		ticks = TIMER_WHEEL_SIZE;
+
+	for (i = 1; i <= ticks; i++) {
+		struct list_head *slot = &timer_wheel[(timer_clock + i) % TIMER_WHEEL_SIZE];
+
+		list_for_each_entry_safe(t, n, slot, list) {
+			if (t->expire > now)
+				continue;
+			list_del(&t->list);
+			list_add_tail(&t->list, &expired);
+		}
+	}
+	timer_clock = now;
+
+	/* a callback may add or delete any timer, including the expired ones */
+	while (!list_empty(&expired)) {
+		t = list_first_entry(&expired, struct hyper_timer, list);
+		list_del_init(&t->list);
+		timer_num--;
+		t->fn(t);
+	}
+
+	hyper_timer_rearm();
+	return 0;
+}
+
+static struct hyper_event_ops hyper_timer_ops = {
+	.read		= hyper_timer_read,
+};
+
+int hyper_timer_setup(int efd)
+{
+	int i;
+
+	for (i = 0; i < TIMER_WHEEL_SIZE; i++)
+		INIT_LIST_HEAD(&timer_wheel[i]);
+
+	hyper_epoll.timer.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (hyper_epoll.timer.fd < 0) {
+		perror("create timerfd failed");
+		return -1;
+	}
+
+	if (hyper_init_event(&hyper_epoll.timer, &hyper_timer_ops, NULL) < 0 ||
+	    hyper_add_event(efd, &hyper_epoll.timer, EPOLLIN) < 0) {
+		fprintf(stderr, "add timerfd event failed\n");
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,21 @@
+#ifndef _TIMER_H
+#define _TIMER_H
+
+#include <inttypes.h>
+
+#include "list.h"
+
+/* a zeroed timer is idle, no init needed */
+struct hyper_timer {
+	struct list_head	list;
+	uint64_t		expire;	// ms of CLOCK_MONOTONIC
+	void			(*fn)(struct hyper_timer *t);
+};
+
+uint64_t hyper_timer_now(void);
+int hyper_timer_pending(struct hyper_timer *t);
+void hyper_timer_add(struct hyper_timer *t, uint32_t msec, void (*fn)(struct hyper_timer *t));
+void hyper_timer_del(struct hyper_timer *t);
+int hyper_timer_setup(int efd);
+
+#endif
@@ -0,0 +1,319 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/vm_sockets.h>
+
+#include "api.h"
+#include "util.h"
+#include "transport.h"
+
+/*
+ * The ctl and tty channels are virtio-serial ports by default. With
+ * hyper.transport=vsock[:PORT] or hyper.transport=unix:DIR on the kernel
+ * cmdline (or HYPER_TRANSPORT in the environment) hyperstart listens on
+ * vsock port PORT + n or on DIR/sh.hyper.channel.n for channel n instead,
+ * and accepts a new connection whenever the peer goes away.
+ */
+
+static int hyper_vsock_listen(struct hyper_transport *t, int idx);
+static int hyper_unix_listen(struct hyper_transport *t, int idx);
+
+static struct hyper_transport_ops hyper_serial_ops = {
+	.name		= "serial",
+};
+
+static struct hyper_transport_ops hyper_vsock_ops = {
+	.name		= "vsock",
+	.listen		= hyper_vsock_listen,
+};
+
+static struct hyper_transport_ops hyper_unix_ops = {
+	.name		= "unix",
+	.listen		= hyper_unix_listen,
+};
+
+static struct hyper_transport hyper_transport = {
+	.ops		= &hyper_serial_ops,
+	.port		= HYPER_VSOCK_PORT,
+	.lfd		= { -1, -1 },
+};
+
+static int hyper_socket_listen(int fd, struct sockaddr *sa, socklen_t len)
+{
+	if (bind(fd, sa, len) < 0) {
+		perror("bind channel socket failed");
+		goto out;
+	}
+
+	if (listen(fd, 1) < 0) {
+		perror("listen on channel socket failed");
+		goto out;
+	}
+
+	return fd;
+out:
+	close(fd);
+	return -1;
+}
+
+static int hyper_vsock_listen(struct hyper_transport *t, int idx)
+{
+	struct sockaddr_vm sa = {
+		.svm_family	= AF_VSOCK,
+		.svm_cid	= VMADDR_CID_ANY,
+		.svm_port	= t->port + idx,
+	};
+	int fd;
+
+	fd = socket(AF_VSOCK, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("create vsock socket failed");
+		return -1;
+	}
+
+	fprintf(stdout, "listen on vsock port %u\n", sa.svm_port);
+	return hyper_socket_listen(fd, (struct sockaddr *)&sa, sizeof(sa));
+}
+
+static int hyper_unix_listen(struct hyper_transport *t, int idx)
+{
+	struct sockaddr_un sa = {
+		.sun_family	= AF_UNIX,
+	};
+	int fd;
+
+	if (snprintf(sa.sun_path, sizeof(sa.sun_path), "%s/sh.hyper.channel.%d",
+		     t->path, idx) >= sizeof(sa.sun_path)) {
+		fprintf(stderr, "unix channel path %s is too long\n", t->path);
+		return -1;
+	}
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("create unix socket failed");
+		return -1;
+	}
+
+	unlink(sa.sun_path);
+	fprintf(stdout, "listen on %s\n", sa.sun_path);
+	return hyper_socket_listen(fd, (struct sockaddr *)&sa, sizeof(sa));
+}
+
+static int hyper_serial_open(int idx, int mode)
+{
+	char name[32];
+
+#ifdef WITH_VBOX
+	sprintf(name, "/dev/ttyS%d", idx);
+#else
+	sprintf(name, "sh.hyper.channel.%d", idx);
+#endif
+	return hyper_open_channel(name, mode);
+}
+
+static char *hyper_transport_option(char *cmdline)
+{
+	char *env = getenv("HYPER_TRANSPORT");
+	char *opt;
+
+	if (env != NULL)
+		return strdup(env);
+
+	if (cmdline == NULL)
+		return NULL;
+
+	opt = strstr(cmdline, "hyper.transport=");
+	if (opt == NULL)
+		return NULL;
+
+	opt += strlen("hyper.transport=");
+	return strndup(opt, strcspn(opt, " \n"));
+}
+
+int hyper_transport_init(char *cmdline)
+{
+	struct hyper_transport *t = &hyper_transport;
+	char *opt, *arg;
+	int i, fd;
+
+	opt = hyper_transport_option(cmdline);
+	if (opt == NULL)
+		return 0;
+
+	arg = strchr(opt, ':');
+	if (arg != NULL)
+		*arg++ = '\0';
+
+	if (!strcmp(opt, "vsock")) {
+		if (arg != NULL)
+			t->port = strtoul(arg, NULL, 10);
+
+		// no vsock device, stay on the serial ports
+		fd = socket(AF_VSOCK, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd < 0) {
+			perror("vsock is not available, use serial ports");
+			goto out;
+		}
+		close(fd);
+		t->ops = &hyper_vsock_ops;
+	} else if (!strcmp(opt, "unix") && arg != NULL) {
+		t->path = strdup(arg);
+		if (t->path == NULL)
+			goto out;
+		t->ops = &hyper_unix_ops;
+	} else if (strcmp(opt, "serial")) {
+		fprintf(stderr, "unknown transport %s, use serial ports\n", opt);
+	}
+
+out:
+	free(opt);
+	fprintf(stdout, "channel transport %s\n", t->ops->name);
+	if (t->ops->listen == NULL)
+		return 0;
+
+	// listen on all channels, the peer may connect them in any order
+	for (i = 0; i < HYPER_CHANNEL_NUM; i++) {
+		t->lfd[i] = t->ops->listen(t, i);
+		if (t->lfd[i] < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* open channel idx, waits for the peer on connection based transports */
+int hyper_transport_open(int idx, int mode)
+{
+	struct hyper_transport *t = &hyper_transport;
+	int fd;
+
+	if (t->ops->listen == NULL)
+		return hyper_serial_open(idx, mode);
+
+	// more stream ports are serial only
+	if (idx >= HYPER_CHANNEL_NUM)
+		return -1;
+
+	fprintf(stdout, "wait for the peer of channel %d\n", idx);
+	do {
+		fd = accept4(t->lfd[idx], NULL, NULL,
+			     SOCK_CLOEXEC | (mode & O_NONBLOCK ? SOCK_NONBLOCK : 0));
+	} while (fd < 0 && errno == EINTR);
+
+	if (fd < 0)
+		perror("accept channel connection failed");
+
+	return fd;
+}
+
+/* the listening socket of channel idx, -1 if the channel has no connections */
+int hyper_transport_listen_fd(int idx)
+{
+	return hyper_transport.lfd[idx];
+}
+
+/* accept the next peer of channel idx, the listening socket is readable */
+int hyper_transport_accept(int idx)
+{
+	int fd;
+
+	do {
+		fd = accept4(hyper_transport.lfd[idx], NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+	} while (fd < 0 && errno == EINTR);
+
+	if (fd < 0 && errno != EAGAIN)
+		perror("accept channel connection failed");
+
+	return fd;
+}
+
+/*
+ * connect a dedicated data channel, vsock:PORT, unix:PATH or serial:NAME,
+ * without blocking. *pending is set if the connect is still in progress,
+ * hyper_transport_connected() tells how it went once the fd is writable.
+ */
+int hyper_transport_connect(char *addr, int *pending)
+{
+	struct sockaddr_vm vm = {
+		.svm_family	= AF_VSOCK,
+		.svm_cid	= VMADDR_CID_HOST,
+	};
+	struct sockaddr_un un = {
+		.sun_family	= AF_UNIX,
+	};
+	struct sockaddr *sa;
+	socklen_t len;
+	int fd;
+
+	*pending = 0;
+	if (!strncmp(addr, "serial:", 7))
+		return hyper_open_channel(addr + 7, 0);
+
+	if (!strncmp(addr, "vsock:", 6)) {
+		vm.svm_port = strtoul(addr + 6, NULL, 10);
+		sa = (struct sockaddr *)&vm;
+		len = sizeof(vm);
+	} else if (!strncmp(addr, "unix:", 5) && strlen(addr + 5) < sizeof(un.sun_path)) {
+		strcpy(un.sun_path, addr + 5);
+		sa = (struct sockaddr *)&un;
+		len = sizeof(un);
+	} else {
+		fprintf(stderr, "invalid data channel %s\n", addr);
+		return -1;
+	}
+
+	fd = socket(sa->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("create data channel socket failed");
+		return -1;
+	}
+
+	if (connect(fd, sa, len) < 0) {
+		if (errno == EINPROGRESS) {
+			fprintf(stdout, "data channel %s is connecting\n", addr);
+			*pending = 1;
+			return fd;
+		}
+		perror("connect data channel failed");
+		close(fd);
+		return -1;
+	}
+
+	if (hyper_setfd_block(fd) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	fprintf(stdout, "data channel %s is connected\n", addr);
+	return fd;
+}
+
+/* the pending connect of fd finished, 0 if it is connected */
+int hyper_transport_connected(int fd)
+{
+	socklen_t len = sizeof(int);
+	int err;
+
+	if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) {
+		perror("get data channel error failed");
+		return -1;
+	}
+
+	if (err != 0) {
+		fprintf(stderr, "connect data channel failed: %s\n", strerror(err));
+		return -1;
+	}
+
+	// the process gets it as its stdio
+	if (hyper_setfd_block(fd) < 0)
+		return -1;
+
+	fprintf(stdout, "data channel fd %d is connected\n", fd);
+	return 0;
+}
@@ -0,0 +1,30 @@
+#ifndef _TRANSPORT_H
+#define _TRANSPORT_H
+
+#define HYPER_CHANNEL_CTL	0
+#define HYPER_CHANNEL_TTY	1
+#define HYPER_CHANNEL_NUM	2
+
+struct hyper_transport;
+
+struct hyper_transport_ops {
+	const char	*name;
+	/* listen on channel idx, NULL if the transport has no connections */
+	int		(*listen)(struct hyper_transport *t, int idx);
+};
+
+struct hyper_transport {
+	struct hyper_transport_ops	*ops;
+	char				*path;	// directory of the unix sockets
+	unsigned int			port;	// vsock port of channel 0
+	int				lfd[HYPER_CHANNEL_NUM];
+};
+
+int hyper_transport_init(char *cmdline);
+int hyper_transport_open(int idx, int mode);
+int hyper_transport_listen_fd(int idx);
+int hyper_transport_accept(int idx);
+int hyper_transport_connect(char *addr, int *pending);
+int hyper_transport_connected(int fd);
+
+#endif
@@ -0,0 +1,398 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <endian.h>
+#include <sys/mman.h>
+
+#include "../config.h"
+#include "syscall.h"
+#include "uring.h"
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+
+/*
+ * The io_uring event backend. Every event is a poll request on the ring,
+ * edge triggered events are multishot polls and level triggered ones are
+ * one shot polls armed again once their handler has run. The requests
+ * queued by a loop iteration reach the kernel with the io_uring_enter
+ * that waits for the next completions.
+ *
+ * The user_data of a poll is the fd and the generation of its slot, the
+ * generation moves on with every change of the event so completions of
+ * stale polls are dropped.
+ */
+#define URING_ENTRIES		256
+#define URING_REMOVE		(~0ULL)	// user_data of poll removals
+
+struct hyper_uring_slot {
+	struct hyper_event	*he;
+	uint32_t		gen;
+	int			flag;
+	int			armed;
+};
+
+static struct hyper_uring {
+	int			fd;
+	unsigned		*sq_head;
+	unsigned		*sq_tail;
+	unsigned		sq_mask;
+	unsigned		sq_entries;
+	unsigned		tail;		// local sq tail, ahead of the kernel
+	struct io_uring_sqe	*sqes;
+	unsigned		*cq_head;
+	unsigned		*cq_tail;
+	unsigned		cq_mask;
+	struct io_uring_cqe	*cqes;
+	int			multishot;
+	struct hyper_uring_slot	*slots;
+	int			nr_slots;
+	/* one shot polls completed by the last batch */
+	uint64_t		*rearm;
+	int			nr_rearm;
+	int			max_rearm;
+} hyper_uring = {
+	.fd		= -1,
+	.multishot	= 1,
+};
+
+static inline uint64_t hyper_uring_data(int fd)
+{
+	return ((uint64_t)hyper_uring.slots[fd].gen << 32) | fd;
+}
+
+static int hyper_uring_submit(int wait)
+{
+	struct hyper_uring *u = &hyper_uring;
+	unsigned queued;
+	int ret;
+
+	__atomic_store_n(u->sq_tail, u->tail, __ATOMIC_RELEASE);
+	queued = u->tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+	if (queued == 0 && !wait)
+		return 0;
+
+	do {
+		ret = hyper_io_uring_enter(u->fd, queued, wait,
+					   wait ? IORING_ENTER_GETEVENTS : 0);
+	} while (ret < 0 && errno == EINTR);
+
+	// the completion queue is full, reap it before submitting more
+	if (ret < 0 && errno == EBUSY)
+		return 0;
+
+	if (ret < 0) {
+		perror("io_uring_enter failed");
+		return -1;
+	}
+
+	return 0;
+}
+
+static struct io_uring_sqe *hyper_uring_sqe(void)
+{
+	struct hyper_uring *u = &hyper_uring;
+	struct io_uring_sqe *sqe;
+
+	if (u->tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries) {
+		if (hyper_uring_submit(0) < 0)
+			return NULL;
+		if (u->tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries) {
+			fprintf(stderr, "io_uring submission queue is full\n");
+			return NULL;
+		}
+	}
+
+	sqe = &u->sqes[u->tail++ & u->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+static int hyper_uring_arm(int fd)
+{
+	struct hyper_uring_slot *slot = &hyper_uring.slots[fd];
+	struct io_uring_sqe *sqe;
+	uint32_t mask = slot->flag & ~(EPOLLET | EPOLLONESHOT);
+
+	sqe = hyper_uring_sqe();
+	if (sqe == NULL)
+		return -1;
+
+#if __BYTE_ORDER == __BIG_ENDIAN
+	mask = (mask << 16) | (mask >> 16);
+#endif
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = mask;
+	if ((slot->flag & EPOLLET) && hyper_uring.multishot)
+		sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = hyper_uring_data(fd);
+	slot->armed = 1;
+	return 0;
+}
+
+/* cancel the poll of fd, completions still on the way become stale */
+static int hyper_uring_disarm(int fd)
+{
+	struct hyper_uring_slot *slot = &hyper_uring.slots[fd];
+	struct io_uring_sqe *sqe;
+
+	if (slot->armed) {
+		sqe = hyper_uring_sqe();
+		if (sqe == NULL)
+			return -1;
+
+		sqe->opcode = IORING_OP_POLL_REMOVE;
+		sqe->fd = -1;
+		sqe->addr = hyper_uring_data(fd);
+		sqe->user_data = URING_REMOVE;
+		slot->armed = 0;
+	}
+
+	slot->gen++;
+	return 0;
+}
+
+static int hyper_uring_slots(int fd)
+{
+	struct hyper_uring *u = &hyper_uring;
+	struct hyper_uring_slot *slots;
+	int nr = u->nr_slots ? u->nr_slots : 64;
+
+	if (fd < u->nr_slots)
+		return 0;
+
+	while (nr <= fd)
+		nr *= 2;
+
+	slots = realloc(u->slots, nr * sizeof(*slots));
+	if (slots == NULL) {
+		fprintf(stderr, "allocate io_uring slots failed\n");
+		return -1;
+	}
+
+	memset(slots + u->nr_slots, 0, (nr - u->nr_slots) * sizeof(*slots));
+	u->slots = slots;
+	u->nr_slots = nr;
+	return 0;
+}
+
+static int hyper_uring_ctl(int efd, int op, struct hyper_event *he, int flag)
+{
+	struct hyper_uring_slot *slot;
+	int fd = he->fd;
+
+	if (fd < 0) {
+		errno = EBADF;
+		return -1;
+	}
+
+	if (hyper_uring_slots(fd) < 0)
+		return -1;
+
+	slot = &hyper_uring.slots[fd];
+	// epoll semantics, a stale slot of a closed fd may be taken over
+	if (op == EPOLL_CTL_ADD && slot->he == he) {
+		errno = EEXIST;
+		return -1;
+	}
+	if (op != EPOLL_CTL_ADD && slot->he != he) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	if (hyper_uring_disarm(fd) < 0)
+		return -1;
+
+	if (op == EPOLL_CTL_DEL) {
+		slot->he = NULL;
+		return 0;
+	}
+
+	slot->he = he;
+	slot->flag = flag;
+	return hyper_uring_arm(fd);
+}
+
+/* a poll holds a reference of the file, drop it before the fd goes */
+static void hyper_uring_close(int efd, struct hyper_event *he)
+{
+	struct hyper_uring_slot *slot;
+
+	if (he->fd < 0 || he->fd >= hyper_uring.nr_slots)
+		return;
+
+	slot = &hyper_uring.slots[he->fd];
+	if (slot->he != he)
+		return;
+
+	slot->he = NULL;
+	if (slot->armed && hyper_uring_disarm(he->fd) == 0)
+		hyper_uring_submit(0);
+}
+
+static int hyper_uring_reap(struct epoll_event *events, int max)
+{
+	struct hyper_uring *u = &hyper_uring;
+	struct hyper_uring_slot *slot;
+	struct io_uring_cqe *cqe;
+	unsigned head = *u->cq_head;
+	unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+	int i, n = 0;
+
+	for (i = 0; head != tail && i < max; head++, i++) {
+		cqe = &u->cqes[head & u->cq_mask];
+		if (cqe->user_data == URING_REMOVE)
+			continue;
+
+		slot = &u->slots[cqe->user_data & 0xffffffff];
+		if (slot->he == NULL || slot->gen != cqe->user_data >> 32)
+			continue;
+
+		if (!(cqe->flags & IORING_CQE_F_MORE)) {
+			slot->armed = 0;
+			u->rearm[u->nr_rearm++] = cqe->user_data;
+		}
+
+		if (cqe->res == -EINVAL && (slot->flag & EPOLLET) && u->multishot) {
+			fprintf(stderr, "no multishot poll, edge triggered events poll one shot\n");
+			u->multishot = 0;
+			continue;
+		}
+		if (cqe->res == -ECANCELED)
+			continue;
+
+		events[n].events = cqe->res < 0 ? EPOLLERR : cqe->res;
+		events[n].data.ptr = slot->he;
+		n++;
+	}
+
+	__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+	return n;
+}
+
+static int hyper_uring_wait(int efd, struct epoll_event *events, int max)
+{
+	struct hyper_uring *u = &hyper_uring;
+	struct hyper_uring_slot *slot;
+	uint64_t *rearm;
+	int i, n, fd;
+
+	if (max > u->max_rearm) {
+		rearm = realloc(u->rearm, max * sizeof(*rearm));
+		if (rearm == NULL) {
+			fprintf(stderr, "allocate io_uring rearm list failed\n");
+			return -1;
+		}
+		u->rearm = rearm;
+		u->max_rearm = max;
+	}
+
+	while (1) {
+		// the handlers of the last batch have run, poll level triggered events again
+		for (i = 0; i < u->nr_rearm; i++) {
+			fd = u->rearm[i] & 0xffffffff;
+			slot = &u->slots[fd];
+			if (slot->he == NULL || slot->armed ||
+			    slot->gen != u->rearm[i] >> 32)
+				continue;
+			if (hyper_uring_arm(fd) < 0)
+				return -1;
+		}
+		u->nr_rearm = 0;
+
+		n = hyper_uring_reap(events, max);
+		if (n > 0)
+			return n;
+
+		if (hyper_uring_submit(1) < 0)
+			return -1;
+	}
+}
+
+static int hyper_uring_create(void)
+{
+	struct hyper_uring *u = &hyper_uring;
+	struct io_uring_params p;
+	size_t sq_size, cq_size;
+	unsigned *array, i;
+	void *ring, *sqes;
+	int fd;
+
+	memset(&p, 0, sizeof(p));
+	fd = hyper_io_uring_setup(URING_ENTRIES, &p);
+	if (fd < 0) {
+		perror("io_uring_setup failed");
+		return -1;
+	}
+
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP)) {
+		fprintf(stderr, "io_uring features %x are not enough\n", p.features);
+		goto out;
+	}
+
+	sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	ring = mmap(NULL, sq_size > cq_size ? sq_size : cq_size, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (ring == MAP_FAILED) {
+		perror("map io_uring rings failed");
+		goto out;
+	}
+
+	sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED) {
+		perror("map io_uring sqes failed");
+		munmap(ring, sq_size > cq_size ? sq_size : cq_size);
+		goto out;
+	}
+
+	u->fd		= fd;
+	u->sq_head	= ring + p.sq_off.head;
+	u->sq_tail	= ring + p.sq_off.tail;
+	u->sq_mask	= *(unsigned *)(ring + p.sq_off.ring_mask);
+	u->sq_entries	= p.sq_entries;
+	u->tail		= *u->sq_tail;
+	u->sqes		= sqes;
+	u->cq_head	= ring + p.cq_off.head;
+	u->cq_tail	= ring + p.cq_off.tail;
+	u->cq_mask	= *(unsigned *)(ring + p.cq_off.ring_mask);
+	u->cqes		= ring + p.cq_off.cqes;
+
+	// sqes are used in ring order
+	array = ring + p.sq_off.array;
+	for (i = 0; i < p.sq_entries; i++)
+		array[i] = i;
+
+	return fd;
+out:
+	close(fd);
+	return -1;
+}
+
+struct hyper_event_backend hyper_uring_backend = {
+	.name		= "io_uring",
+	.create		= hyper_uring_create,
+	.ctl		= hyper_uring_ctl,
+	.wait		= hyper_uring_wait,
+	.close		= hyper_uring_close,
+};
+
+#else
+
+static int hyper_uring_create(void)
+{
+	fprintf(stderr, "built without io_uring support\n");
+	return -1;
+}
+
+struct hyper_event_backend hyper_uring_backend = {
+	.name		= "io_uring",
+	.create		= hyper_uring_create,
+};
+
+#endif
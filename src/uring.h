@@ -0,0 +1,8 @@
+#ifndef _URING_H
+#define _URING_H
+
+#include "event.h"
+
+extern struct hyper_event_backend hyper_uring_backend;
+
+#endif
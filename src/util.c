@@ -27,7 +27,23 @@
 
 char *read_cmdline(void)
 {
-	return NULL;
+	char *cmdline = NULL;
+	size_t size = 0;
+	FILE *fp;
+
+	fp = fopen("/proc/cmdline", "r");
+	if (fp == NULL) {
+		perror("open /proc/cmdline failed");
+		return NULL;
+	}
+
+	if (getline(&cmdline, &size, fp) < 0) {
+		free(cmdline);
+		cmdline = NULL;
+	}
+
+	fclose(fp);
+	return cmdline;
 }
 
 int hyper_setup_env(struct env *envs, int num)
@@ -123,10 +139,14 @@ int hyper_find_sd(char *addr, char **dev)
 	return 0;
 }
 
-static unsigned long id_or_max(const char *name)
+/* the id in name, ~0UL if it isn't a number */
+unsigned long hyper_id_or_max(const char *name)
 {
 	char *ptr;
-	long id = strtol(name, &ptr, 10);
+	long id;
+
+	errno = 0;
+	id = strtol(name, &ptr, 10);
 	if (name == ptr || id < 0 || (errno != 0 && id == 0) || *ptr != '\0')
 		return ~0UL;
 	return id;
@@ -135,7 +155,7 @@ static unsigned long id_or_max(const char *name)
 // the same as getpwnam(), but it only parses /etc/passwd and allows name to be id string
 struct passwd *hyper_getpwnam(const char *name)
 {
-	uid_t uid = (uid_t)id_or_max(name);
+	uid_t uid = (uid_t)hyper_id_or_max(name);
 	FILE *file = fopen("/etc/passwd", "r");
 	if (!file) {
 		perror("faile to open /etc/passwd");
@@ -157,7 +177,7 @@ struct passwd *hyper_getpwnam(const char *name)
 // the same as getgrnam(), but it only parses /etc/group and allows the name to be id string
 struct group *hyper_getgrnam(const char *name)
 {
-	gid_t gid = (gid_t)id_or_max(name);
+	gid_t gid = (gid_t)hyper_id_or_max(name);
 	FILE *file = fopen("/etc/group", "r");
 	if (!file) {
 		perror("faile to open /etc/group");
@@ -321,19 +341,43 @@ int hyper_mkdir(char *path, mode_t mode)
 	return 0;
 }
 
-void online_cpu(void)
+/*
+ * online the device of the online file, -1 if it is still offline. A write
+ * may fail for one that is online already, its state tells.
+ */
+static int hyper_online_dev(const char *path, const char *name)
+{
+	char state = 0;
+	int fd, ret;
+
+	fd = open(path, O_RDWR);
+	if (fd < 0) {
+		fprintf(stderr, "open %s failed\n", path);
+		return 0;
+	}
+	printf("try to online %s\n", name);
+	ret = write(fd, "1", sizeof("1"));
+	if (ret != 2 && (pread(fd, &state, 1, 0) != 1 || state != '1'))
+		ret = -1;
+	printf("online %s result: %s\n", name, ret < 0 ? "failed" : "success");
+	close(fd);
+	return ret < 0 ? -1 : 0;
+}
+
+/* returns how many of them are still offline */
+int online_cpu(void)
 {
+	int failed = 0;
 	DIR *dir = opendir("/sys/devices/system/cpu");
 	if (dir == NULL) {
 		fprintf(stderr, "open dir /sys/devices/system/cpu failed\n");
-		return;
+		return 0;
 	}
 	printf("online_cpu()\n");
 	for (;;) {
 		int num;
 		int ret;
 		char path[256];
-		int fd;
 
 		struct dirent *entry = readdir(dir);
 		if (entry == NULL)
@@ -344,32 +388,27 @@ void online_cpu(void)
 		if (ret < 1 || num == 0) /* skip none cpu%d and cpu0 */
 			continue;
 		sprintf(path, "/sys/devices/system/cpu/%s/online", entry->d_name);
-		fd = open(path, O_RDWR);
-		if (fd < 0) {
-			fprintf(stderr, "open %s failed\n", path);
-			continue;
-		}
-		printf("try to online %s\n", entry->d_name);
-		ret = write(fd, "1", sizeof("1"));
-		printf("online %s result: %s\n", entry->d_name, ret == 2 ? "success" : "failed");
-		close(fd);
+		if (hyper_online_dev(path, entry->d_name) < 0)
+			failed++;
 	}
 	closedir(dir);
+	return failed;
 }
 
-void online_memory(void)
+/* returns how many of them are still offline */
+int online_memory(void)
 {
+	int failed = 0;
 	DIR *dir = opendir("/sys/devices/system/memory");
 	if (dir == NULL) {
 		fprintf(stderr, "open dir /sys/devices/system/memory failed\n");
-		return;
+		return 0;
 	}
 	printf("online_memory()\n");
 	for (;;) {
 		int num;
 		int ret;
 		char path[256];
-		int fd;
 
 		struct dirent *entry = readdir(dir);
 		if (entry == NULL)
@@ -380,17 +419,11 @@ void online_memory(void)
 		if (ret < 1 || num == 0) /* skip none memory%d and memory0 */
 			continue;
 		sprintf(path, "/sys/devices/system/memory/%s/online", entry->d_name);
-		fd = open(path, O_RDWR);
-		if (fd < 0) {
-			fprintf(stderr, "open %s failed\n", path);
-			continue;
-		}
-		printf("try to online %s\n", entry->d_name);
-		ret = write(fd, "1", sizeof("1"));
-		printf("online %s result: %s\n", entry->d_name, ret == 2 ? "success" : "failed");
-		close(fd);
+		if (hyper_online_dev(path, entry->d_name) < 0)
+			failed++;
 	}
 	closedir(dir);
+	return failed;
 }
 
 #if WITH_VBOX
@@ -515,13 +548,15 @@ int hyper_open_channel(char *channel, int mode)
 		fd = open(path, O_RDONLY);
 
 		memset(name, 0, sizeof(name));
-		if (fd < 0 || read(fd, name, sizeof(name)) < 0)
+		if (fd < 0 || read(fd, name, sizeof(name) - 1) < 0)
 			continue;
 
 		close(fd);
 		fd = -1;
 
-		if (strncmp(name, channel, strlen(channel))) {
+		// the name ends with a newline, sh.hyper.channel.1 isn't sh.hyper.channel.10
+		name[strcspn(name, "\n")] = '\0';
+		if (strcmp(name, channel)) {
 			continue;
 		}
 
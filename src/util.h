@@ -22,8 +22,8 @@ int hyper_find_sd(char *addr, char **dev);
 int hyper_list_dir(char *path);
 int hyper_copy_dir(char *src, char *dst);
 void hyper_sync_time_hctosys();
-void online_cpu(void);
-void online_memory(void);
+int online_cpu(void);
+int online_memory(void);
 int hyper_cmd(char *cmd);
 int hyper_create_file(const char *hyper_path);
 void hyper_filize(char *hyper_path);
@@ -36,6 +36,7 @@ int hyper_setfd_nonblock(int fd);
 int hyper_socketpair(int domain, int type, int protocol, int sv[2]);
 void hyper_shutdown();
 int hyper_insmod(char *module);
+unsigned long hyper_id_or_max(const char *name);
 struct passwd *hyper_getpwnam(const char *name);
 struct group *hyper_getgrnam(const char *name);
 int hyper_getgrouplist(const char *user, gid_t group, gid_t *groups, int *ngroups);